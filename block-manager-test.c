@@ -1,19 +1,38 @@
 #include "md/persistent-data/dm-block-manager.h"
+#include "dm-block-manager-trace.h"
 
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/crc32c.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
 
 /*----------------------------------------------------------------*/
 
 #define BM_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (64 * 1024)
 #define NR_BLOCKS 1024
 #define CACHE_SIZE 16
 
+static unsigned block_size = BM_BLOCK_SIZE;
+module_param(block_size, uint, 0444);
+MODULE_PARM_DESC(block_size, "metadata block size in bytes (4096 - 65536)");
+
 typedef int (*test_fn)(struct dm_block_manager *);
 
-static unsigned char data[BM_BLOCK_SIZE];
+static unsigned char data[MAX_BLOCK_SIZE];
+
+/* the device the current test's block manager is on */
+static struct block_device *test_bdev;
 
 static void barf(const char *msg)
 {
@@ -21,33 +40,42 @@ static void barf(const char *msg)
 	BUG_ON(1);
 }
 
-static int run_test(const char *name, test_fn fn)
+static int run_test_with_cache(const char *name, test_fn fn, unsigned cache_size)
 {
 	int r;
 	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
 	struct block_device *bdev = blkdev_get_by_path("/dev/sdb",
 						       mode,
-						       &run_test);
+						       &run_test_with_cache);
 	struct dm_block_manager *bm;
+	ktime_t start;
 
 	if (IS_ERR(bdev))
 		return -1;
 	printk(KERN_ALERT "bdev opened\n");
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	bm = dm_block_manager_create(bdev, block_size, cache_size);
 
 	if (!bm)
 		barf("couldn't create bm");
+	test_bdev = bdev;
 
 	printk(KERN_ALERT "running %s ... ", name);
+	start = ktime_get();
 	r = fn(bm);
-	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
+	printk(KERN_ALERT "%s (%lld us)\n", r == 0 ? "pass" : "fail",
+	       ktime_to_us(ktime_sub(ktime_get(), start)));
 
 	dm_block_manager_destroy(bm);
 	blkdev_put(bdev, mode);
 	return 0;
 }
 
+static int run_test(const char *name, test_fn fn)
+{
+	return run_test_with_cache(name, fn, CACHE_SIZE);
+}
+
 static int read_test(struct dm_block_manager *bm)
 {
 	int i;
@@ -57,8 +85,8 @@ static int read_test(struct dm_block_manager *bm)
 		if (dm_bm_read_lock(bm, i, &b) < 0)
 			barf("dm_bm_lock failed");
 
-		memset(data, i, sizeof(data));
-		if (memcmp(data, dm_block_data(b), BM_BLOCK_SIZE))
+		memset(data, i, block_size);
+		if (memcmp(data, dm_block_data(b), block_size))
 			printk(KERN_ALERT "block %d failed\n", i);
 
 		if (dm_bm_unlock(b) < 0)
@@ -73,6 +101,81 @@ static int read_test(struct dm_block_manager *bm)
 	return 0;
 }
 
+static unsigned long long per_sec(unsigned long long count, s64 us)
+{
+	return us > 0 ? div64_u64(count * USEC_PER_SEC, us) : 0;
+}
+
+static unsigned long long mb_per_sec(unsigned long long bytes, s64 us)
+{
+	return us > 0 ? div64_u64(bytes, us) : 0;
+}
+
+/*
+ * Compares the rate at which cold read locks deliver block data with
+ * reading the same bytes straight from the device through the buffer
+ * cache, one synchronous page at a time, and with the rate at which we
+ * can simply copy them.  If read locks fall well short of the device
+ * then the block manager's own overhead, rather than the device, is
+ * what limits metadata reads.  The copy is made from NR_BLOCKS separate
+ * buffers, so it isn't just reading one block out of L1.
+ */
+#define COPY_PASSES 16
+#define RAW_READ_SIZE 4096
+
+static int read_bandwidth(struct dm_block_manager *bm)
+{
+	unsigned pass;
+	sector_t i;
+	dm_block_t bi;
+	struct dm_block *b;
+	struct buffer_head *bh;
+	ktime_t start;
+	s64 read_us, raw_us, copy_us;
+	unsigned long long bytes = (unsigned long long) NR_BLOCKS * block_size;
+	unsigned char *buffers;
+
+	start = ktime_get();
+	for (bi = 0; bi < NR_BLOCKS; bi++) {
+		if (dm_bm_read_lock(bm, bi, &b) < 0)
+			barf("dm_bm_read_lock failed");
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+	read_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	invalidate_bdev(test_bdev);
+	start = ktime_get();
+	for (i = 0; i < div_u64(bytes, RAW_READ_SIZE); i++) {
+		bh = __bread(test_bdev, i, RAW_READ_SIZE);
+		if (!bh)
+			barf("__bread failed");
+		brelse(bh);
+	}
+	raw_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	invalidate_bdev(test_bdev);
+
+	buffers = vmalloc(bytes);
+	if (!buffers)
+		return -ENOMEM;
+	memset(buffers, 0, bytes);
+
+	start = ktime_get();
+	for (pass = 0; pass < COPY_PASSES; pass++)
+		for (bi = 0; bi < NR_BLOCKS; bi++)
+			memcpy(data, buffers + bi * block_size, block_size);
+	copy_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	vfree(buffers);
+
+	printk(KERN_ALERT "cold read locks %llu MB/s, raw device reads %llu MB/s, memcpy %llu MB/s\n",
+	       mb_per_sec(bytes, read_us), mb_per_sec(bytes, raw_us),
+	       mb_per_sec(bytes * COPY_PASSES, copy_us));
+
+	return 0;
+}
+
 /*
  * scrolls a window of write locks across the device.
  */
@@ -89,7 +192,7 @@ static int windowed_writes(struct dm_block_manager *bm)
 		if (dm_bm_write_lock(bm, bi, pb) < 0)
 			barf("couldn't lock block");
 
-		memset(dm_block_data(*pb), 1, BM_BLOCK_SIZE);
+		memset(dm_block_data(*pb), 1, block_size);
 	}
 
 	if (dm_bm_locks_held(bm) != WINDOW_SIZE) {
@@ -105,7 +208,7 @@ static int windowed_writes(struct dm_block_manager *bm)
 		if (dm_bm_write_lock(bm, bi, pb) < 0)
 			barf("couldn't lock block");
 
-		memset(dm_block_data(*pb), 1, BM_BLOCK_SIZE);
+		memset(dm_block_data(*pb), 1, block_size);
 	}
 
 
@@ -116,14 +219,14 @@ static int windowed_writes(struct dm_block_manager *bm)
 			barf("dm_bm_unlock");
 	}
 
-	memset(data, 1, BM_BLOCK_SIZE);
+	memset(data, 1, block_size);
 	for (bi = 0; bi < NR_BLOCKS; bi++) {
 		struct dm_block *blk;
 
 		if (dm_bm_read_lock(bm, bi, &blk) < 0)
 			barf("dm_bm_lock");
 
-		BUG_ON(memcmp(dm_block_data(blk), data, BM_BLOCK_SIZE));
+		BUG_ON(memcmp(dm_block_data(blk), data, block_size));
 
 		if (dm_bm_unlock(blk) < 0)
 			barf("dm_bm_unlock");
@@ -135,7 +238,7 @@ static int windowed_writes(struct dm_block_manager *bm)
 		if (dm_bm_read_lock(bm, bi, &blk) < 0)
 			barf("dm_bm_lock");
 
-		BUG_ON(memcmp(dm_block_data(blk), data, BM_BLOCK_SIZE));
+		BUG_ON(memcmp(dm_block_data(blk), data, block_size));
 
 		if (dm_bm_unlock(blk) < 0)
 			barf("dm_bm_unlock");
@@ -144,6 +247,512 @@ static int windowed_writes(struct dm_block_manager *bm)
 	return 0;
 }
 
+/*
+ * Writes back anything dirty, then fills a cache of |cache_size| blocks
+ * with the last cache_size blocks of the device, so none of the blocks
+ * below those are left in it.
+ */
+#define COLD_BLOCKS (NR_BLOCKS - CACHE_SIZE)
+
+static void chill_cache(struct dm_block_manager *bm, unsigned cache_size)
+{
+	dm_block_t bi;
+	struct dm_block *b;
+
+	if (dm_bm_write_lock(bm, NR_BLOCKS - cache_size, &b) < 0)
+		barf("dm_bm_write_lock failed");
+
+	if (dm_bm_flush_and_unlock(bm, b) < 0)
+		barf("dm_bm_flush_and_unlock failed");
+
+	for (bi = NR_BLOCKS - cache_size; bi < NR_BLOCKS; bi++) {
+		if (dm_bm_read_lock(bm, bi, &b) < 0)
+			barf("dm_bm_read_lock failed");
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+}
+
+/*
+ * Flushes the block manager, write locking |last| to do it; pick a block
+ * that's already in the cache.
+ */
+static void flush_last(struct dm_block_manager *bm, dm_block_t last)
+{
+	struct dm_block *b;
+
+	if (dm_bm_write_lock(bm, last, &b) < 0)
+		barf("dm_bm_write_lock failed");
+
+	if (dm_bm_flush_and_unlock(bm, b) < 0)
+		barf("dm_bm_flush_and_unlock failed");
+}
+
+/*
+ * A write lock always reads the old contents of the block, even when the
+ * caller is about to overwrite all of it.  Compare the cost of write
+ * locking and overwriting cold blocks with that of just reading the
+ * same blocks cold.  With a small cache the write pass also writes back
+ * the dirty blocks it evicts, so both passes end with a flush inside the
+ * timed region and the write pass includes writing every block back.  A
+ * zeroing lock would still pay for that write back; what it saves is
+ * roughly the read pass.
+ */
+static int write_lock_cost(struct dm_block_manager *bm)
+{
+	dm_block_t bi;
+	struct dm_block *b;
+	ktime_t start;
+	s64 read_us, write_us;
+
+	chill_cache(bm, CACHE_SIZE);
+	start = ktime_get();
+	for (bi = 0; bi < COLD_BLOCKS; bi++) {
+		if (dm_bm_read_lock(bm, bi, &b) < 0)
+			barf("dm_bm_read_lock failed");
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+	flush_last(bm, COLD_BLOCKS - 1);
+	read_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	chill_cache(bm, CACHE_SIZE);
+	start = ktime_get();
+	for (bi = 0; bi < COLD_BLOCKS; bi++) {
+		if (dm_bm_write_lock(bm, bi, &b) < 0)
+			barf("dm_bm_write_lock failed");
+
+		memset(dm_block_data(b), 1, block_size);
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+	flush_last(bm, COLD_BLOCKS - 1);
+	write_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	printk(KERN_ALERT "%u cold blocks, each pass ending in a flush: read lock %lld us, write lock + overwrite + write back %lld us\n",
+	       COLD_BLOCKS, read_us, write_us);
+
+	return 0;
+}
+
+/*
+ * Read locks a set of blocks in ascending order, so any misses go to the
+ * device in disk order.  On failure everything already locked is
+ * released.
+ */
+static int cmp_block(const void *lhs, const void *rhs)
+{
+	dm_block_t l = *(const dm_block_t *) lhs, r = *(const dm_block_t *) rhs;
+
+	return l < r ? -1 : (l > r ? 1 : 0);
+}
+
+static int read_lock_many(struct dm_block_manager *bm, dm_block_t *blocks,
+			  unsigned count, struct dm_block **result)
+{
+	int r;
+	unsigned i;
+
+	sort(blocks, count, sizeof(*blocks), cmp_block, NULL);
+
+	for (i = 0; i < count; i++) {
+		r = dm_bm_read_lock(bm, blocks[i], result + i);
+		if (r < 0) {
+			while (i--)
+				dm_bm_unlock(result[i]);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static void random_set(dm_block_t *blocks, unsigned count, unsigned limit)
+{
+	unsigned i, j;
+
+	for (i = 0; i < count; i++) {
+	again:
+		blocks[i] = prandom_u32_max(limit);
+		for (j = 0; j < i; j++)
+			if (blocks[j] == blocks[i])
+				goto again;
+	}
+}
+
+/*
+ * Locks random sets of blocks, first one at a time in the order they
+ * were chosen and then through read_lock_many(), and reports the mean
+ * time per set.  Both ways lock the same set, each starting from a cold
+ * cache.  The cache has to be big enough to hold the largest set.
+ */
+#define MAX_SET_SIZE 32
+#define SETS_PER_SIZE 32
+#define MULTI_LOCK_CACHE_SIZE (2 * MAX_SET_SIZE)
+
+static unsigned set_sizes[] = { 8, 16, MAX_SET_SIZE };
+
+static void unlock_set(struct dm_block **locked, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		if (dm_bm_unlock(locked[i]) < 0)
+			barf("dm_bm_unlock failed");
+}
+
+static int lock_sets(struct dm_block_manager *bm)
+{
+	unsigned i, j, set;
+	dm_block_t blocks[MAX_SET_SIZE];
+	struct dm_block *locked[MAX_SET_SIZE];
+	ktime_t start;
+	s64 single_us, many_us;
+
+	for (i = 0; i < ARRAY_SIZE(set_sizes); i++) {
+		single_us = many_us = 0;
+
+		for (set = 0; set < SETS_PER_SIZE; set++) {
+			random_set(blocks, set_sizes[i],
+				   NR_BLOCKS - MULTI_LOCK_CACHE_SIZE);
+
+			chill_cache(bm, MULTI_LOCK_CACHE_SIZE);
+			start = ktime_get();
+			for (j = 0; j < set_sizes[i]; j++)
+				if (dm_bm_read_lock(bm, blocks[j], locked + j) < 0)
+					barf("dm_bm_read_lock failed");
+			single_us += ktime_to_us(ktime_sub(ktime_get(), start));
+			unlock_set(locked, set_sizes[i]);
+
+			chill_cache(bm, MULTI_LOCK_CACHE_SIZE);
+			start = ktime_get();
+			if (read_lock_many(bm, blocks, set_sizes[i], locked) < 0)
+				barf("read_lock_many failed");
+			many_us += ktime_to_us(ktime_sub(ktime_get(), start));
+			unlock_set(locked, set_sizes[i]);
+		}
+
+		printk(KERN_ALERT "%u blocks: individual locks %lld us/set, sorted batch %lld us/set\n",
+		       set_sizes[i], div_s64(single_us, SETS_PER_SIZE),
+		       div_s64(many_us, SETS_PER_SIZE));
+	}
+
+	if (dm_bm_locks_held(bm) != 0) {
+		printk(KERN_ALERT "locks still held %u\n", dm_bm_locks_held(bm));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Checksummed blocks keep a crc32c of the rest of the block in their
+ * first four bytes.  crc32c() picks up the hardware accelerated version
+ * if the cpu has one.
+ */
+#define CSUM_XOR 0x1ee7c0de
+
+static uint32_t block_csum(void *data)
+{
+	return crc32c(~(uint32_t) 0, (__le32 *) data + 1,
+		      block_size - sizeof(__le32)) ^ CSUM_XOR;
+}
+
+static void stamp_block(void *data)
+{
+	*(__le32 *) data = cpu_to_le32(block_csum(data));
+}
+
+static int verify_block(void *data)
+{
+	return le32_to_cpu(*(__le32 *) data) == block_csum(data) ? 0 : -EILSEQ;
+}
+
+/*
+ * Read locks a checksummed block, failing with -EILSEQ, and leaving it
+ * unlocked, if the checksum doesn't match.
+ */
+static int csum_read_lock(struct dm_block_manager *bm, dm_block_t b,
+			  struct dm_block **result)
+{
+	int r = dm_bm_read_lock(bm, b, result);
+	if (r < 0)
+		return r;
+
+	r = verify_block(dm_block_data(*result));
+	if (r < 0)
+		dm_bm_unlock(*result);
+
+	return r;
+}
+
+/*
+ * Writes then reads every block, with and without checksums, and reports
+ * what the checksumming adds per block.
+ */
+static s64 csum_write_pass(struct dm_block_manager *bm, int csum)
+{
+	dm_block_t bi;
+	struct dm_block *b;
+	ktime_t start = ktime_get();
+
+	for (bi = 0; bi < NR_BLOCKS; bi++) {
+		if (dm_bm_write_lock(bm, bi, &b) < 0)
+			barf("dm_bm_write_lock failed");
+
+		memset(dm_block_data(b), 1, block_size);
+		if (csum)
+			stamp_block(dm_block_data(b));
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+
+	return ktime_to_us(ktime_sub(ktime_get(), start));
+}
+
+static s64 csum_read_pass(struct dm_block_manager *bm, int csum)
+{
+	dm_block_t bi;
+	struct dm_block *b;
+	ktime_t start = ktime_get();
+
+	for (bi = 0; bi < NR_BLOCKS; bi++) {
+		if (csum ? csum_read_lock(bm, bi, &b) < 0 :
+			   dm_bm_read_lock(bm, bi, &b) < 0)
+			barf("read lock failed");
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+
+	return ktime_to_us(ktime_sub(ktime_get(), start));
+}
+
+static int checksum_overhead(struct dm_block_manager *bm)
+{
+	s64 write_us, write_csum_us, read_us, read_csum_us;
+
+	write_us = csum_write_pass(bm, 0);
+	read_us = csum_read_pass(bm, 0);
+	write_csum_us = csum_write_pass(bm, 1);
+	read_csum_us = csum_read_pass(bm, 1);
+
+	printk(KERN_ALERT "writes %lld us -> %lld us, reads %lld us -> %lld us with crc32c\n",
+	       write_us, write_csum_us, read_us, read_csum_us);
+
+	return 0;
+}
+
+/*
+ * Changes a block on disk through a block manager of its own, so the
+ * change is made behind the back of the one under test.
+ */
+static int with_block(struct block_device *bdev, dm_block_t blk,
+		      void (*fn)(void *, void *),
+		      void *context)
+{
+	int r;
+	struct dm_block_manager *bm;
+	struct dm_block *b;
+
+	bm = dm_block_manager_create(bdev, block_size, 1);
+	if (!bm) {
+		printk(KERN_ALERT "%s: couldn't create bm", __func__);
+		return -1;
+	}
+
+	r = dm_bm_write_lock(bm, blk, &b);
+	if (r)
+		printk(KERN_ALERT "%s: couldn't lock block", __func__);
+	else {
+		fn(context, dm_block_data(b));
+		r = dm_bm_flush_and_unlock(bm, b);
+	}
+
+	dm_block_manager_destroy(bm);
+	return r;
+}
+
+static void stamp_(void *context, void *data)
+{
+	memset(data, 7, block_size);
+	stamp_block(data);
+}
+
+static void flip_byte_(void *context, void *data)
+{
+	unsigned char *bytes = data;
+	bytes[*(size_t *) context] ^= 0xff;
+}
+
+/*
+ * Writes a checksummed block, flips one byte of it on disk, and checks
+ * that a read through csum_read_lock() by a block manager that hasn't
+ * seen the block before reports the corruption.
+ */
+#define CORRUPT_BLOCK 0
+
+static int checksum_catches_corruption(void)
+{
+	int r;
+	size_t offset = block_size / 2;
+	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode,
+						       &checksum_catches_corruption);
+	struct dm_block_manager *bm;
+	struct dm_block *b;
+
+	if (IS_ERR(bdev))
+		return -1;
+
+	printk(KERN_ALERT "running crc32c catches corruption ... ");
+
+	r = with_block(bdev, CORRUPT_BLOCK, stamp_, NULL);
+	if (r < 0)
+		goto out;
+
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
+	if (!bm)
+		barf("couldn't create bm");
+
+	r = csum_read_lock(bm, CORRUPT_BLOCK, &b);
+	if (r < 0)
+		printk(KERN_ALERT "intact block failed its checksum\n");
+	else
+		dm_bm_unlock(b);
+	dm_block_manager_destroy(bm);
+	if (r < 0)
+		goto out;
+
+	r = with_block(bdev, CORRUPT_BLOCK, flip_byte_, &offset);
+	if (r < 0)
+		goto out;
+
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
+	if (!bm)
+		barf("couldn't create bm");
+
+	r = csum_read_lock(bm, CORRUPT_BLOCK, &b);
+	if (r == -EILSEQ)
+		r = 0;
+	else {
+		if (!r) {
+			printk(KERN_ALERT "corruption went undetected\n");
+			dm_bm_unlock(b);
+		}
+		r = -1;
+	}
+	dm_block_manager_destroy(bm);
+
+out:
+	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
+	blkdev_put(bdev, mode);
+	return r;
+}
+
+/*
+ * Threads, each pinned to its own cpu, repeatedly read lock a small set
+ * of blocks that are always in the cache.  The block manager isn't safe
+ * for concurrent lockers yet, so the threads take turns under a single
+ * mutex.  This is a baseline for the shared hit path behind one lock,
+ * not a measure of how it scales: comparing the aggregate rate against
+ * a single thread shows what the lock handoffs and cache line bouncing
+ * cost.
+ */
+#define HOT_BLOCKS 8
+#define HIT_LOCKS 100000
+#define MAX_HIT_THREADS 16
+
+struct hit_thread {
+	struct dm_block_manager *bm;
+	struct mutex *lock;
+	unsigned index;
+	int cpu;
+	struct completion done;
+};
+
+static int hit_thread_fn(void *context)
+{
+	struct hit_thread *ht = context;
+	unsigned i;
+	struct dm_block *b;
+
+	for (i = 0; i < HIT_LOCKS; i++) {
+		mutex_lock(ht->lock);
+		if (dm_bm_read_lock(ht->bm, (ht->index + i) % HOT_BLOCKS, &b) < 0)
+			barf("dm_bm_read_lock failed");
+
+		if (dm_bm_unlock(b) < 0)
+			barf("dm_bm_unlock failed");
+		mutex_unlock(ht->lock);
+	}
+
+	complete(&ht->done);
+	return 0;
+}
+
+static s64 run_hit_threads(struct dm_block_manager *bm, unsigned nr_threads)
+{
+	int cpu;
+	unsigned i = 0;
+	struct mutex lock;
+	struct task_struct *task;
+	static struct hit_thread threads[MAX_HIT_THREADS];
+	ktime_t start;
+
+	mutex_init(&lock);
+	for_each_online_cpu(cpu) {
+		if (i == nr_threads)
+			break;
+
+		threads[i].bm = bm;
+		threads[i].lock = &lock;
+		threads[i].index = i;
+		threads[i].cpu = cpu;
+		init_completion(&threads[i].done);
+		i++;
+	}
+	nr_threads = i;
+
+	start = ktime_get();
+	for (i = 0; i < nr_threads; i++) {
+		task = kthread_create(hit_thread_fn, threads + i, "bm-hit/%d",
+				      threads[i].cpu);
+		if (IS_ERR(task))
+			barf("couldn't start thread");
+
+		kthread_bind(task, threads[i].cpu);
+		wake_up_process(task);
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		wait_for_completion(&threads[i].done);
+
+	return ktime_to_us(ktime_sub(ktime_get(), start));
+}
+
+static int hot_block_hits(struct dm_block_manager *bm)
+{
+	unsigned nr_threads = min(num_online_cpus(), (unsigned) MAX_HIT_THREADS);
+	s64 one_us, many_us;
+
+	/* warm the cache */
+	run_hit_threads(bm, 1);
+
+	one_us = run_hit_threads(bm, 1);
+	many_us = run_hit_threads(bm, nr_threads);
+
+	printk(KERN_ALERT "behind one lock: 1 thread %llu locks/sec, %u pinned threads %llu locks/sec\n",
+	       per_sec(HIT_LOCKS, one_us), nr_threads,
+	       per_sec((unsigned long long) HIT_LOCKS * nr_threads, many_us));
+
+	return 0;
+}
+
 /* FIXME: this behaviour will change, when we start to support concurrency
  * properly.
  */
@@ -194,6 +803,169 @@ static int double_write_lock_fails(struct dm_block_manager *bm)
 	return 0;
 }
 
+/*
+ * Captures a trace of a windowed write workload, followed by a flush and
+ * a read back, and replays it against a fresh block manager.  The trace
+ * stays readable in debugfs until the module is unloaded.
+ */
+#define TRACE_NAME "dm-bm-trace"
+#define TRACE_EVENTS 8192
+
+static struct dm_bm_trace *bm_trace;
+
+static void traced_workload(struct dm_block_manager *bm)
+{
+	dm_block_t bi;
+	struct dm_block *b;
+	static struct dm_block *blocks[WINDOW_SIZE];
+
+	for (bi = 0; bi < NR_BLOCKS; bi++) {
+		if (bi >= WINDOW_SIZE &&
+		    dm_bm_trace_unlock(bm_trace, blocks[bi % WINDOW_SIZE]) < 0)
+			barf("dm_bm_unlock failed");
+
+		if (dm_bm_trace_write_lock(bm_trace, bm, bi, blocks + (bi % WINDOW_SIZE)) < 0)
+			barf("dm_bm_write_lock failed");
+
+		memset(dm_block_data(blocks[bi % WINDOW_SIZE]), 1, block_size);
+	}
+
+	for (bi = 0; bi < WINDOW_SIZE; bi++)
+		if (dm_bm_trace_unlock(bm_trace, blocks[bi]) < 0)
+			barf("dm_bm_unlock failed");
+
+	if (dm_bm_trace_write_lock(bm_trace, bm, 0, &b) < 0)
+		barf("dm_bm_write_lock failed");
+
+	if (dm_bm_trace_flush_and_unlock(bm_trace, bm, b) < 0)
+		barf("dm_bm_flush_and_unlock failed");
+
+	for (bi = 0; bi < NR_BLOCKS; bi++) {
+		if (dm_bm_trace_read_lock(bm_trace, bm, bi, &b) < 0)
+			barf("dm_bm_read_lock failed");
+
+		if (dm_bm_trace_unlock(bm_trace, b) < 0)
+			barf("dm_bm_unlock failed");
+	}
+}
+
+static int replay(struct dm_block_manager *bm, struct dm_bm_trace_event *events,
+		  unsigned nr)
+{
+	int r = 0;
+	unsigned i;
+	static struct dm_block *held[NR_BLOCKS];
+
+	for (i = 0; i < nr; i++) {
+		struct dm_bm_trace_event *e = events + i;
+
+		/* calls that failed first time round changed nothing */
+		if (e->result < 0)
+			continue;
+
+		if (e->block >= NR_BLOCKS)
+			return -EINVAL;
+
+		switch (e->op) {
+		case BM_TRACE_READ_LOCK:
+			r = dm_bm_read_lock(bm, e->block, held + e->block);
+			break;
+
+		case BM_TRACE_WRITE_LOCK:
+			r = dm_bm_write_lock(bm, e->block, held + e->block);
+			break;
+
+		case BM_TRACE_UNLOCK:
+		case BM_TRACE_FLUSH_AND_UNLOCK:
+			if (!held[e->block]) {
+				printk(KERN_ALERT "event %u unlocks a block that isn't locked\n", i);
+				return -EINVAL;
+			}
+
+			if (e->op == BM_TRACE_UNLOCK)
+				r = dm_bm_unlock(held[e->block]);
+			else
+				r = dm_bm_flush_and_unlock(bm, held[e->block]);
+			held[e->block] = NULL;
+			break;
+		}
+
+		if (r < 0) {
+			printk(KERN_ALERT "replay of event %u failed\n", i);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static int check_trace_replay(void)
+{
+	int r;
+	unsigned nr;
+	unsigned long lost;
+	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode, &check_trace_replay);
+	struct dm_block_manager *bm;
+	struct dm_bm_trace_event *events;
+	ktime_t start;
+	s64 capture_us, replay_us;
+
+	if (IS_ERR(bdev))
+		return -1;
+
+	printk(KERN_ALERT "running trace and replay ... ");
+
+	bm_trace = dm_bm_trace_create(TRACE_NAME, TRACE_EVENTS);
+	if (!bm_trace)
+		barf("couldn't create trace");
+
+	events = vmalloc(sizeof(*events) * TRACE_EVENTS);
+	if (!events)
+		barf("couldn't allocate events");
+
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
+	if (!bm)
+		barf("couldn't create bm");
+
+	start = ktime_get();
+	traced_workload(bm);
+	capture_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	dm_block_manager_destroy(bm);
+
+	nr = dm_bm_trace_copy(bm_trace, events, TRACE_EVENTS, &lost);
+	if (lost) {
+		printk(KERN_ALERT "trace lost %lu events, not replaying\n", lost);
+		printk(KERN_ALERT "fail\n");
+		vfree(events);
+		blkdev_put(bdev, mode);
+		return -1;
+	}
+
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
+	if (!bm)
+		barf("couldn't create bm");
+
+	start = ktime_get();
+	r = replay(bm, events, nr);
+	replay_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	if (!r && dm_bm_locks_held(bm) != 0) {
+		printk(KERN_ALERT "locks still held %u\n", dm_bm_locks_held(bm));
+		r = -1;
+	}
+
+	printk(KERN_ALERT "%u events, captured in %lld us, replayed in %lld us (%lld ns per event)\n",
+	       nr, capture_us, replay_us,
+	       nr ? div_s64(replay_us * NSEC_PER_USEC, nr) : 0);
+	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
+
+	dm_block_manager_destroy(bm);
+	vfree(events);
+	blkdev_put(bdev, mode);
+	return r;
+}
+
 /*----------------------------------------------------------------*/
 
 static int block_manager_test_init(void)
@@ -203,21 +975,38 @@ static int block_manager_test_init(void)
 		test_fn fn;
 	} table_[] = {
 		{"read blocks", read_test},
+		{"read bandwidth", read_bandwidth},
 		{"windowed writes", windowed_writes},
+		{"cost of write locking blocks we overwrite", write_lock_cost},
+		{"crc32c overhead", checksum_overhead},
+		{"read locks of hot blocks, single lock baseline", hot_block_hits},
 		{"trying to read lock twice", double_read_lock_fails},
 		{"trying to write lock twice", double_write_lock_fails}
 	};
 
 	int i;
 
+	if (block_size < BM_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1))) {
+		printk(KERN_ALERT "unsupported block size %u\n", block_size);
+		return -EINVAL;
+	}
+
 	for (i = 0; i < sizeof(table_) / sizeof(*table_); i++)
 		run_test(table_[i].name, table_[i].fn);
 
+	run_test_with_cache("locking sets of blocks", lock_sets, MULTI_LOCK_CACHE_SIZE);
+	checksum_catches_corruption();
+	check_trace_replay();
+
 	return 0;
 }
 
 static void block_manager_test_exit(void)
 {
+	if (bm_trace)
+		dm_bm_trace_destroy(bm_trace);
+
 	printk(KERN_ALERT "block_manager_test exit\n");
 }
 
@@ -1,10 +1,19 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/atomic.h>
 #include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
 
 #include "md/persistent-data/dm-btree.h"
+#include "md/persistent-data/dm-btree-internal.h"
 #include "md/persistent-data/dm-transaction-manager.h"
+#include "dm-btree-ext.h"
 #include "dm-space-map-core.h"
 
 /*----------------------------------------------------------------*/
@@ -14,6 +23,7 @@
 #define CACHE_SIZE 16		/* small enough that there will be a lot of contention */
 
 typedef int (*test_fn)(struct dm_transaction_manager *);
+typedef int (*bench_fn)(struct block_device *);
 
 /*----------------------------------------------------------------*/
 
@@ -55,16 +65,51 @@ static uint64_t next_rand(uint64_t last)
 	return a * last + c;
 }
 
+/*
+ * Reports the shape of a tree, so we can see how insert and remove
+ * orders affect fill and the metadata needed per mapping.
+ */
+static int print_tree_stats(struct dm_btree_info *info, dm_block_t root,
+			    const char *when)
+{
+	int r;
+	struct dm_btree_stats stats;
+
+	r = dm_btree_walk_stats(info, root, &stats);
+	if (r < 0) {
+		printk(KERN_ALERT "dm_btree_walk_stats failed");
+		return r;
+	}
+
+	printk(KERN_ALERT "%s: depth %u, %lu internal, %lu leaves, %lu mappings, fill %lu%% (min %u%%), %llu bytes/mapping",
+	       when, stats.depth, stats.nr_internal, stats.nr_leaves,
+	       stats.nr_mappings,
+	       stats.nr_entries * 100 / stats.nr_slots, stats.min_fill,
+	       (unsigned long long) (stats.nr_mappings ?
+				     div64_u64(stats.metadata_bytes, stats.nr_mappings) :
+				     stats.metadata_bytes));
+
+	return 0;
+}
+
+/*
+ * Also reports the mean cost of an insert, leaving out time spent
+ * committing.  The first insert down a path in a transaction has to
+ * shadow it and later ones don't, so comparing commit intervals shows
+ * what shadowing, and checking for existing shadows, adds per insert.
+ */
 #define INSERT_COUNT 5000
 static int check_insert_commit_every(struct dm_transaction_manager *tm,
 				     unsigned commit_interval)
 {
-	int r, i, committed = 1;
+	int r, i;
 	uint64_t key = 0;
 	uint64_t value = 0;
-	dm_block_t root = 0;
+	dm_block_t root = 0, sb;
 	struct dm_btree_info info;
 	struct dm_block *superblock;
+	ktime_t start, commit_start;
+	s64 total_us, commit_us = 0;
 
 	info.tm = tm;
 	info.levels = 1;
@@ -78,6 +123,7 @@ static int check_insert_commit_every(struct dm_transaction_manager *tm,
 		printk(KERN_ALERT "begin failed");
 		return r;
 	}
+	sb = dm_block_location(superblock);
 
 	r = dm_btree_empty(&info, &root);
 	if (r < 0) {
@@ -86,8 +132,8 @@ static int check_insert_commit_every(struct dm_transaction_manager *tm,
 	}
 
 	/* write some random entries into the btree */
+	start = ktime_get();
 	for (i = 0; i < INSERT_COUNT; i++) {
-		committed = 0;
 		key = next_rand(value);
 		value = next_rand(key);
 		r = dm_btree_insert(&info, root, &key, &value, &root);
@@ -96,18 +142,26 @@ static int check_insert_commit_every(struct dm_transaction_manager *tm,
 			return r;
 		}
 
-		if ((i + 1 % commit_interval) == 0) {
-			dm_block_t b = dm_block_location(superblock);
+		if ((i + 1) % commit_interval == 0) {
+			commit_start = ktime_get();
 			commit(tm, superblock);
-			r = begin_again(tm, b, &superblock);
+			commit_us += ktime_to_us(ktime_sub(ktime_get(), commit_start));
+
+			r = begin_again(tm, sb, &superblock);
 			if (r < 0)
 				return r;
-			committed = 1;
 		}
 	}
 
-	if (!committed)
-		commit(tm, superblock);
+	commit_start = ktime_get();
+	commit(tm, superblock);
+	commit_us += ktime_to_us(ktime_sub(ktime_get(), commit_start));
+	total_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	printk(KERN_ALERT "commit every %u: %lld ns/insert, %lld us committing\n",
+	       commit_interval,
+	       div_s64((total_us - commit_us) * NSEC_PER_USEC, INSERT_COUNT),
+	       commit_us);
 
 	/* check they're all still there */
 	key = value = 0;
@@ -126,7 +180,7 @@ static int check_insert_commit_every(struct dm_transaction_manager *tm,
 		}
 	}
 
-	return 0;
+	return print_tree_stats(&info, root, "random inserts");
 }
 
 static int check_insert(struct dm_transaction_manager *tm)
@@ -298,7 +352,8 @@ static int check_insert_h(struct dm_transaction_manager *tm)
 			return -1;
 		}
 	}
-	return 0;
+
+	return print_tree_stats(&info, root, "4 level tree");
 }
 
 #define MAX_LEVELS 4
@@ -356,7 +411,7 @@ static int do_remove_scenario(struct dm_btree_info *info, dm_block_t root)
 		return -1;
 	}
 
-	return 0;
+	return print_tree_stats(info, root, "after remove");
 }
 
 static int check_remove_one(struct dm_transaction_manager *tm)
@@ -516,6 +571,10 @@ static int insert_remove_many_scenario(
 		}
 	}
 
+	r = print_tree_stats(&info, root, "after inserts");
+	if (r < 0)
+		return r;
+
 	for (check = c + 1; check < count; check++) {
 		uint64_t k = order[check];
 		void *value;
@@ -549,9 +608,15 @@ static int insert_remove_many_scenario(
 			printk(KERN_ALERT "remove didn't work for %d", order[c]);
 			return -1;
 		}
+
+		if (c == count / 2) {
+			r = print_tree_stats(&info, root, "half removed");
+			if (r < 0)
+				return r;
+		}
 	}
 
-	return 0;
+	return print_tree_stats(&info, root, "all removed");
 }
 
 #define COUNT 1000
@@ -635,62 +700,2165 @@ static int check_insert_remove_many_center(struct dm_transaction_manager *tm)
 	return insert_remove_many_scenario(tm, order, COUNT);
 }
 
-/*----------------------------------------------------------------*/
+/*
+ * Inserts a shuffled, spaced out set of keys, removes a shuffled half of
+ * them, then checks lookup_next and lookup_prev from every key in and
+ * around the range against a bitmap.
+ */
+#define SPARSE_GAP 10
+#define SPARSE_LIMIT (COUNT * SPARSE_GAP)
 
-static int run_test(const char *name, test_fn fn)
+static int check_nearest(struct dm_btree_info *info, dm_block_t root,
+			 uint8_t *present, uint64_t probe, int next)
 {
 	int r;
-	struct dm_space_map *sm = dm_sm_core_create(NR_BLOCKS);
-	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
-	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode, &run_test);
-	struct dm_block_manager *bm;
-	struct dm_transaction_manager *tm;
+	int64_t expected = probe;
+	uint64_t key = probe, value;
+
+	if (next)
+		while (expected < SPARSE_LIMIT && !present[expected])
+			expected++;
+	else {
+		if (expected >= SPARSE_LIMIT)
+			expected = SPARSE_LIMIT - 1;
+		while (expected >= 0 && !present[expected])
+			expected--;
+	}
 
-	if (IS_ERR(bdev))
-		return -1;
+	if (next)
+		r = dm_btree_lookup_next(info, root, &key, &value);
+	else
+		r = dm_btree_lookup_prev(info, root, &key, &value);
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
-	if (!bm)
-		return -1;
+	if (expected < 0 || expected >= SPARSE_LIMIT) {
+		if (r != -ENODATA) {
+			printk(KERN_ALERT "lookup_%s(%llu) found %llu, expected nothing",
+			       next ? "next" : "prev", (unsigned long long) probe,
+			       (unsigned long long) key);
+			return -1;
+		}
 
-	tm = dm_tm_create(bm, sm);
-	if (!tm)
+		return 0;
+	}
+
+	if (r < 0 || key != expected || value != key * 3) {
+		printk(KERN_ALERT "lookup_%s(%llu) gave %llu, expected %llu",
+		       next ? "next" : "prev", (unsigned long long) probe,
+		       (unsigned long long) key, (unsigned long long) expected);
 		return -1;
+	}
 
-	printk(KERN_ALERT "running %s ... ", name);
-	r = fn(tm);
-	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
+	return 0;
+}
+
+static int check_lookup_nearest(struct dm_transaction_manager *tm)
+{
+	int r;
+	unsigned i;
+	uint64_t key, value, probe;
+	dm_block_t root;
+	struct dm_btree_info info;
+	struct dm_block *superblock;
+	static unsigned order[COUNT];
+	static uint8_t present[SPARSE_LIMIT];
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		return r;
+
+	r = dm_btree_empty(&info, &root);
+	if (r < 0)
+		return r;
+
+	memset(present, 0, sizeof(present));
+	for (i = 0; i < COUNT; i++)
+		order[i] = i;
+	shuffle(order, COUNT);
+
+	for (i = 0; i < COUNT; i++) {
+		key = order[i] * SPARSE_GAP + random(SPARSE_GAP);
+		value = key * 3;
+		r = dm_btree_insert(&info, root, &key, &value, &root);
+		if (r < 0)
+			return r;
+		present[key] = 1;
+	}
+
+	shuffle(order, COUNT);
+	for (i = 0; i < COUNT / 2; i++) {
+		key = order[i] * SPARSE_GAP;
+		r = dm_btree_lookup_next(&info, root, &key, &value);
+		if (r < 0)
+			return r;
 
+		r = dm_btree_remove(&info, root, &key, &root);
+		if (r < 0)
+			return r;
+		present[key] = 0;
+	}
+	commit(tm, superblock);
+
+	for (probe = 0; probe < SPARSE_LIMIT + SPARSE_GAP; probe++) {
+		r = check_nearest(&info, root, present, probe, 1);
+		if (r < 0)
+			return r;
+
+		r = check_nearest(&info, root, present, probe, 0);
+		if (r < 0)
+			return r;
+	}
+
+	return print_tree_stats(&info, root, "sparse tree");
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Benchmarks.  These need control over how the block manager is
+ * created, so they set up their own block and transaction managers
+ * rather than using the ones run_test() provides.
+ */
+static int open_tm(struct block_device *bdev, struct dm_space_map *sm,
+		   unsigned block_size, unsigned cache_size,
+		   struct dm_block_manager **bm,
+		   struct dm_transaction_manager **tm)
+{
+	*bm = dm_block_manager_create(bdev, block_size, cache_size);
+	if (!*bm)
+		return -ENOMEM;
+
+	*tm = dm_tm_create(*bm, sm);
+	if (!*tm) {
+		dm_block_manager_destroy(*bm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void close_tm(struct dm_block_manager *bm, struct dm_transaction_manager *tm)
+{
 	dm_tm_destroy(tm);
 	dm_block_manager_destroy(bm);
-	blkdev_put(bdev, mode);
+}
+
+static unsigned long long per_sec(unsigned long long count, s64 us)
+{
+	return us > 0 ? div64_u64(count * USEC_PER_SEC, us) : 0;
+}
+
+/*
+ * The block manager can't change its cache size once created, so each
+ * 'resize' commits, tears down the block and transaction managers and
+ * reopens them with the new size.  The tree survives this since the
+ * space map is in core and everything else is on disk.  Reopening
+ * leaves the cache empty, so each phase starts with untimed lookups of
+ * random keys to bring the cache back to its usual state.
+ */
+static unsigned resize_cache_sizes[] = { 16, 64, 256, 64, 16 };
+#define RESIZE_PHASE_INSERTS 2000
+#define RESIZE_WARMUP_LOOKUPS 1000
+
+static int bench_insert_resizing_cache(struct block_device *bdev)
+{
+	int r = 0;
+	unsigned phase, i;
+	uint64_t key, value = 0, probe = 1, dummy;
+	dm_block_t root = 0, sb = 0;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+	ktime_t start;
+	s64 us;
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	for (phase = 0; phase < ARRAY_SIZE(resize_cache_sizes); phase++) {
+		r = open_tm(bdev, sm, BM_BLOCK_SIZE, resize_cache_sizes[phase],
+			    &bm, &tm);
+		if (r < 0) {
+			printk(KERN_ALERT "couldn't open tm with cache size %u",
+			       resize_cache_sizes[phase]);
+			break;
+		}
+		info.tm = tm;
+
+		if (phase == 0) {
+			r = begin(tm, &superblock);
+			if (r < 0)
+				goto out;
+
+			sb = dm_block_location(superblock);
+			r = dm_btree_empty(&info, &root);
+		} else
+			r = begin_again(tm, sb, &superblock);
+
+		if (r < 0)
+			goto out;
+
+		for (i = 0; i < RESIZE_WARMUP_LOOKUPS; i++) {
+			probe = next_rand(probe);
+			r = dm_btree_lookup(&info, root, &probe, &dummy);
+			if (r < 0 && r != -ENODATA)
+				goto out;
+		}
+
+		start = ktime_get();
+		for (i = 0; i < RESIZE_PHASE_INSERTS; i++) {
+			key = next_rand(value);
+			value = next_rand(key);
+			r = dm_btree_insert(&info, root, &key, &value, &root);
+			if (r < 0) {
+				printk(KERN_ALERT "dm_btree_insert failed");
+				goto out;
+			}
+		}
+		commit(tm, superblock);
+		us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+		printk(KERN_ALERT "cache %u blocks, warmed: %llu inserts/sec\n",
+		       resize_cache_sizes[phase],
+		       per_sec(RESIZE_PHASE_INSERTS, us));
+
+		close_tm(bm, tm);
+	}
+
 	dm_sm_destroy(sm);
+	return r;
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Follows the leftmost path down to a leaf.
+ */
+static int tree_depth(struct dm_transaction_manager *tm, dm_block_t root,
+		      unsigned *depth)
+{
+	int r;
+	uint32_t flags;
+	struct dm_block *b;
+	struct node *n;
+
+	*depth = 0;
+	do {
+		r = dm_tm_read_lock(tm, root, &b);
+		if (r < 0)
+			return r;
+
+		n = dm_block_data(b);
+		flags = le32_to_cpu(n->header.flags);
+		if (flags & INTERNAL_NODE)
+			root = le64_to_cpu(n->keys[le32_to_cpu(n->header.max_entries)]);
+
+		dm_tm_unlock(tm, b);
+		(*depth)++;
+	} while (flags & INTERNAL_NODE);
+
 	return 0;
 }
 
-static int btree_test_init(void)
+/*
+ * Builds the same tree at each metadata block size and reports depth,
+ * insert and lookup throughput, and the metadata footprint after the
+ * commit.
+ */
+static unsigned block_sizes[] = { 4096, 8192, 16384, 32768, 65536 };
+#define BLOCK_SIZE_INSERTS 10000
+
+static int bench_one_block_size(struct block_device *bdev, unsigned block_size)
 {
-	static struct {
-		const char *name;
-		test_fn fn;
-	} table_[] = {
-		{"lookup in an empty btree", check_lookup_empty},
-		{"check insert", check_insert},
-		{"check insert, commit every 100", check_multiple_commits},
-		{"check hierarchical insert", check_insert_h},
-		{"insert one, remove one", check_remove_one},
-		{"insert many, remove one", check_removal_with_internal_nodes},
-		{"insert many, remove one, hierarchical", check_removal_in_hierarchy},
-		{"repeated insert/remove linear order", check_insert_remove_many},
-		{"repeated insert/remove linear order", check_insert_remove_many_reverse},
-		{"repeated insert/remove random order", check_insert_remove_many_random},
-		{"repeated insert/remove center order", check_insert_remove_many_center},
-	};
+	int r;
+	unsigned i, depth;
+	uint64_t key, value = 0, value2;
+	dm_block_t root = 0, nr_free;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+	ktime_t start;
+	s64 insert_us, lookup_us;
 
-	int i;
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
 
-	for (i = 0; i < sizeof(table_) / sizeof(*table_); i++)
-		run_test(table_[i].name, table_[i].fn);
+	r = open_tm(bdev, sm, block_size, CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		printk(KERN_ALERT "couldn't open tm with block size %u", block_size);
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+
+	r = dm_btree_empty(&info, &root);
+	if (r < 0)
+		goto out;
+
+	start = ktime_get();
+	for (i = 0; i < BLOCK_SIZE_INSERTS; i++) {
+		key = next_rand(value);
+		value = next_rand(key);
+		r = dm_btree_insert(&info, root, &key, &value, &root);
+		if (r < 0) {
+			printk(KERN_ALERT "dm_btree_insert failed");
+			goto out;
+		}
+	}
+	commit(tm, superblock);
+	insert_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	value = 0;
+	start = ktime_get();
+	for (i = 0; i < BLOCK_SIZE_INSERTS; i++) {
+		key = next_rand(value);
+		value = next_rand(key);
+		r = dm_btree_lookup(&info, root, &key, &value2);
+		if (r < 0) {
+			printk(KERN_ALERT "dm_btree_lookup failed");
+			goto out;
+		}
+	}
+	lookup_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	r = tree_depth(tm, root, &depth);
+	if (r < 0)
+		goto out;
+
+	r = dm_sm_get_nr_free(sm, &nr_free);
+	if (r < 0)
+		goto out;
+
+	printk(KERN_ALERT "block size %u: depth %u, %llu inserts/sec, %llu lookups/sec, %llu metadata bytes\n",
+	       block_size, depth,
+	       per_sec(BLOCK_SIZE_INSERTS, insert_us),
+	       per_sec(BLOCK_SIZE_INSERTS, lookup_us),
+	       (unsigned long long) (NR_BLOCKS - nr_free) * block_size);
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+static int bench_block_sizes(struct block_device *bdev)
+{
+	int r;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(block_sizes); i++) {
+		r = bench_one_block_size(bdev, block_sizes[i]);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * Builds and commits a single level tree mapping each key in
+ * [0, nr_keys) to itself.
+ */
+static int populate_identity(struct dm_btree_info *info, uint64_t nr_keys,
+			     dm_block_t *root)
+{
+	int r;
+	uint64_t key, value;
+	struct dm_block *superblock;
+
+	r = begin(info->tm, &superblock);
+	if (r < 0)
+		return r;
+
+	r = dm_btree_empty(info, root);
+	if (r < 0)
+		return r;
+
+	for (key = 0; key < nr_keys; key++) {
+		value = key;
+		r = dm_btree_insert(info, *root, &key, &value, root);
+		if (r < 0) {
+			printk(KERN_ALERT "dm_btree_insert failed");
+			return r;
+		}
+	}
+	commit(info->tm, superblock);
+
+	return 0;
+}
+
+/*
+ * Random lookups over a committed tree of about 80 blocks, through a
+ * cache that holds only the upper levels and a few leaves, so most
+ * lookups miss, and then through one that holds the whole tree.  Each
+ * pass follows an untimed one so the cache is in its steady state.  The
+ * big cache rate is bounded by how fast the block manager hands out
+ * cached block data.
+ */
+#define STORM_NR_KEYS 10000
+#define STORM_SMALL_CACHE_SIZE 8
+#define STORM_CACHE_SIZE 1024
+#define STORM_LOOKUPS 200000
+
+static unsigned storm_cache_sizes[] = { STORM_SMALL_CACHE_SIZE, STORM_CACHE_SIZE };
+
+static int lookup_storm_pass(struct dm_btree_info *info, dm_block_t root,
+			     s64 *us)
+{
+	int r;
+	unsigned i;
+	uint64_t key, value;
+	ktime_t start = ktime_get();
+
+	for (i = 0; i < STORM_LOOKUPS; i++) {
+		key = random(STORM_NR_KEYS);
+		r = dm_btree_lookup(info, root, &key, &value);
+		if (r < 0)
+			return r;
+
+		if (value != key)
+			return -EINVAL;
+	}
+	*us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	return 0;
+}
+
+static int bench_lookup_storm(struct block_device *bdev)
+{
+	int r;
+	unsigned i;
+	dm_block_t root = 0;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	s64 us;
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, STORM_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = populate_identity(&info, STORM_NR_KEYS, &root);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(storm_cache_sizes); i++) {
+		close_tm(bm, tm);
+		r = open_tm(bdev, sm, BM_BLOCK_SIZE, storm_cache_sizes[i], &bm, &tm);
+		if (r < 0) {
+			dm_sm_destroy(sm);
+			return r;
+		}
+		info.tm = tm;
+
+		r = lookup_storm_pass(&info, root, &us);
+		if (r < 0)
+			goto out;
+
+		r = lookup_storm_pass(&info, root, &us);
+		if (r < 0)
+			goto out;
+
+		printk(KERN_ALERT "%u block cache: %llu lookups/sec\n",
+		       storm_cache_sizes[i], per_sec(STORM_LOOKUPS, us));
+	}
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Lookup threads pinned to cpus on each numa node, all hitting one tree.
+ * The block manager, and so its buffers, is created and the tree built
+ * and read into the cache by a thread pinned to the first of those cpus,
+ * so buffer memory comes from that cpu's node.  The block manager
+ * doesn't support concurrent lockers yet, so the lookup threads run one
+ * after another; the per-node rates show the cost of touching remote
+ * buffers.
+ */
+#define NUMA_NR_KEYS 10000
+#define NUMA_CACHE_SIZE 1024
+#define NUMA_LOOKUPS 100000
+#define MAX_LOOKUP_THREADS 8
+#define CPUS_PER_NODE 2
+
+struct lookup_thread {
+	struct dm_btree_info *info;
+	dm_block_t root;
+	int cpu;
+	int r;
+	s64 us;
+	struct completion done;
+};
+
+/*
+ * The key stride is prime to NUMA_NR_KEYS, so every key gets looked up.
+ */
+static int lookup_thread_fn(void *context)
+{
+	struct lookup_thread *lt = context;
+	unsigned i;
+	uint64_t key, value;
+	ktime_t start = ktime_get();
+
+	for (i = 0; i < NUMA_LOOKUPS; i++) {
+		key = (i * 7919) % NUMA_NR_KEYS;
+
+		lt->r = dm_btree_lookup(lt->info, lt->root, &key, &value);
+		if (lt->r < 0)
+			break;
+
+		if (value != key) {
+			lt->r = -EINVAL;
+			break;
+		}
+	}
+
+	lt->us = ktime_to_us(ktime_sub(ktime_get(), start));
+	complete(&lt->done);
+	return 0;
+}
+
+static int run_pinned(int (*fn)(void *), void *context, int cpu,
+		      struct completion *done)
+{
+	struct task_struct *task;
+
+	init_completion(done);
+
+	task = kthread_create(fn, context, "btree-numa/%d", cpu);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	kthread_bind(task, cpu);
+	wake_up_process(task);
+	wait_for_completion(done);
+
+	return 0;
+}
+
+static int run_lookup_thread(struct lookup_thread *lt)
+{
+	int r;
+
+	lt->r = 0;
+	r = run_pinned(lookup_thread_fn, lt, lt->cpu, &lt->done);
+
+	return r < 0 ? r : lt->r;
+}
+
+struct numa_setup {
+	struct block_device *bdev;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_btree_info *info;
+	dm_block_t root;
+	int r;
+	struct completion done;
+};
+
+/*
+ * Runs on the home cpu: creates the block manager, builds the tree and
+ * reads every node of it into the cache.
+ */
+static int numa_setup_fn(void *context)
+{
+	struct numa_setup *ns = context;
+	uint64_t key, value;
+
+	ns->r = open_tm(ns->bdev, ns->sm, BM_BLOCK_SIZE, NUMA_CACHE_SIZE,
+			&ns->bm, &ns->tm);
+	if (ns->r < 0)
+		goto out;
+
+	ns->info->tm = ns->tm;
+	ns->r = populate_identity(ns->info, NUMA_NR_KEYS, &ns->root);
+	if (ns->r < 0)
+		goto out;
+
+	for (key = 0; key < NUMA_NR_KEYS; key++) {
+		ns->r = dm_btree_lookup(ns->info, ns->root, &key, &value);
+		if (ns->r < 0)
+			break;
+	}
+
+out:
+	complete(&ns->done);
+	return 0;
+}
+
+static int bench_numa_lookups(struct block_device *bdev)
+{
+	int r, cpu, home_node;
+	unsigned i, nr_threads = 0, *per_node;
+	struct dm_btree_info info;
+	struct numa_setup ns;
+	static struct lookup_thread threads[MAX_LOOKUP_THREADS];
+
+	per_node = kcalloc(nr_node_ids, sizeof(*per_node), GFP_KERNEL);
+	if (!per_node)
+		return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		if (nr_threads == MAX_LOOKUP_THREADS)
+			break;
+
+		if (per_node[cpu_to_node(cpu)]++ >= CPUS_PER_NODE)
+			continue;
+
+		threads[nr_threads].info = &info;
+		threads[nr_threads].cpu = cpu;
+		nr_threads++;
+	}
+	kfree(per_node);
+
+	ns.sm = dm_sm_core_create(NR_BLOCKS);
+	if (!ns.sm)
+		return -ENOMEM;
+
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	ns.bdev = bdev;
+	ns.bm = NULL;
+	ns.tm = NULL;
+	ns.info = &info;
+	home_node = cpu_to_node(threads[0].cpu);
+	r = run_pinned(numa_setup_fn, &ns, threads[0].cpu, &ns.done);
+	if (!r)
+		r = ns.r;
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].root = ns.root;
+		r = run_lookup_thread(threads + i);
+		if (r < 0)
+			goto out;
+
+		printk(KERN_ALERT "cpu %d, node %d (%s): %llu lookups/sec\n",
+		       threads[i].cpu, cpu_to_node(threads[i].cpu),
+		       cpu_to_node(threads[i].cpu) == home_node ? "local" : "remote",
+		       per_sec(NUMA_LOOKUPS, threads[i].us));
+	}
+
+out:
+	if (ns.tm)
+		close_tm(ns.bm, ns.tm);
+	dm_sm_destroy(ns.sm);
+	return r;
+}
+
+/*
+ * Inserts with a commit every |interval| inserts, splitting the time
+ * between inserting and committing.  With commits pipelined behind the
+ * next transaction the two would overlap, so N / max(insert, commit)
+ * is the best a pipelined mode could do; we report that bound next to
+ * what the synchronous commits achieve.
+ */
+#define PIPELINE_INSERTS 10000
+static unsigned pipeline_intervals[] = { 10, 100, 1000 };
+
+static int bench_one_commit_interval(struct block_device *bdev, unsigned interval)
+{
+	int r;
+	unsigned i;
+	uint64_t key, value = 0;
+	dm_block_t root = 0, sb = 0;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+	ktime_t start, now;
+	s64 insert_ns = 0, commit_ns = 0, insert_us, commit_us;
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+	sb = dm_block_location(superblock);
+
+	r = dm_btree_empty(&info, &root);
+	if (r < 0)
+		goto out;
+
+	/*
+	 * Each batch of inserts and each commit is timed as a whole, in ns,
+	 * and converted once at the end.
+	 */
+	start = ktime_get();
+	for (i = 0; i < PIPELINE_INSERTS; i++) {
+		key = next_rand(value);
+		value = next_rand(key);
+
+		r = dm_btree_insert(&info, root, &key, &value, &root);
+		if (r < 0)
+			goto out;
+
+		if ((i + 1) % interval == 0) {
+			now = ktime_get();
+			insert_ns += ktime_to_ns(ktime_sub(now, start));
+
+			commit(tm, superblock);
+			r = begin_again(tm, sb, &superblock);
+			if (r < 0)
+				goto out;
+
+			start = ktime_get();
+			commit_ns += ktime_to_ns(ktime_sub(start, now));
+		}
+	}
+	insert_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	commit(tm, superblock);
+
+	insert_us = div_s64(insert_ns, NSEC_PER_USEC);
+	commit_us = div_s64(commit_ns, NSEC_PER_USEC);
+
+	printk(KERN_ALERT "commit every %u: %llu inserts/sec synchronous, %llu inserts/sec pipelined at best\n",
+	       interval, per_sec(PIPELINE_INSERTS, insert_us + commit_us),
+	       per_sec(PIPELINE_INSERTS, max(insert_us, commit_us)));
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+static int bench_commit_intervals(struct block_device *bdev)
+{
+	int r;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(pipeline_intervals); i++) {
+		r = bench_one_commit_interval(bdev, pipeline_intervals[i]);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+/*
+ * Read only views of the last commit.  Each view is a private block
+ * manager and transaction manager over the same device and space map.
+ * Committed blocks are never written in place, so lookups through a view
+ * against a committed root need no coordination with the writer, as
+ * long as the writer doesn't free anything under that root.  Here the
+ * writer builds a separate tree, so it never does.
+ */
+#define RO_NR_KEYS 10000
+#define RO_CACHE_SIZE 256
+#define RO_LOOKUPS 100000
+#define RO_COMMIT_INTERVAL 100
+#define MAX_READERS 8
+
+/*
+ * The writer stops here, so its tree stays well inside the NR_BLOCKS
+ * core space map however long the readers take.
+ */
+#define RO_MAX_INSERTS 20000
+
+struct reader {
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	dm_block_t root;
+	unsigned index;
+	int r;
+	s64 us;
+	atomic_t *running;
+	atomic_t *stop;
+	struct completion done;
+};
+
+static int reader_fn(void *context)
+{
+	struct reader *rd = context;
+	unsigned i;
+	uint64_t key, value;
+	struct dm_btree_info info;
+	ktime_t start = ktime_get();
+
+	info.tm = rd->tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	rd->r = 0;
+	for (i = 0; i < RO_LOOKUPS && !atomic_read(rd->stop); i++) {
+		key = (i * 7919 + rd->index * 104729) % RO_NR_KEYS;
+		rd->r = dm_btree_lookup(&info, rd->root, &key, &value);
+		if (rd->r < 0)
+			break;
+
+		if (value != key) {
+			rd->r = -EINVAL;
+			break;
+		}
+	}
+
+	rd->us = ktime_to_us(ktime_sub(ktime_get(), start));
+	atomic_dec(rd->running);
+	complete(&rd->done);
+	return 0;
+}
+
+/*
+ * Runs the readers to completion, with the writer inserting random keys
+ * into its own tree until they finish, or it reaches RO_MAX_INSERTS, if
+ * |writer| is set.  Returns the aggregate lookup rate.  If a reader
+ * can't be started, those that were are stopped early and the error
+ * returned.
+ */
+static int run_readers(struct reader *readers, unsigned nr_readers,
+		       struct dm_btree_info *writer,
+		       unsigned long long *lookups_per_sec)
+{
+	int r = 0, start_r = 0;
+	unsigned i, inserts = 0;
+	uint64_t key, value = 0;
+	dm_block_t root = 0, sb = 0;
+	struct dm_block *superblock = NULL;
+	struct task_struct *task;
+	atomic_t running, stop;
+	s64 us = 0;
+
+	if (writer) {
+		r = begin(writer->tm, &superblock);
+		if (r < 0)
+			return r;
+		sb = dm_block_location(superblock);
+
+		r = dm_btree_empty(writer, &root);
+		if (r < 0)
+			return r;
+	}
+
+	atomic_set(&running, nr_readers);
+	atomic_set(&stop, 0);
+	for (i = 0; i < nr_readers; i++) {
+		readers[i].running = &running;
+		readers[i].stop = &stop;
+		init_completion(&readers[i].done);
+		task = kthread_run(reader_fn, readers + i, "btree-reader/%u", i);
+		if (IS_ERR(task)) {
+			start_r = PTR_ERR(task);
+			atomic_set(&stop, 1);
+			atomic_sub(nr_readers - i, &running);
+			nr_readers = i;
+			break;
+		}
+	}
+
+	while (writer && !start_r && atomic_read(&running) &&
+	       inserts < RO_MAX_INSERTS) {
+		key = next_rand(value);
+		value = next_rand(key);
+		r = dm_btree_insert(writer, root, &key, &value, &root);
+		if (r < 0)
+			break;
+
+		if (++inserts % RO_COMMIT_INTERVAL == 0) {
+			commit(writer->tm, superblock);
+			r = begin_again(writer->tm, sb, &superblock);
+			if (r < 0)
+				break;
+		}
+	}
+
+	for (i = 0; i < nr_readers; i++) {
+		wait_for_completion(&readers[i].done);
+		if (readers[i].r < 0)
+			r = readers[i].r;
+		us = max(us, readers[i].us);
+	}
+
+	if (writer) {
+		commit(writer->tm, superblock);
+		printk(KERN_ALERT "writer managed %u inserts\n", inserts);
+	}
+
+	if (start_r)
+		return start_r;
+
+	*lookups_per_sec = per_sec((unsigned long long) RO_LOOKUPS * nr_readers, us);
+	return r;
+}
+
+static int bench_readers_and_writer(struct block_device *bdev)
+{
+	int r;
+	unsigned i, nr_readers = min(num_online_cpus(), (unsigned) MAX_READERS);
+	unsigned long long alone, with_writer;
+	dm_block_t root = 0;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	static struct reader readers[MAX_READERS];
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	/* transaction T */
+	r = populate_identity(&info, RO_NR_KEYS, &root);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < nr_readers; i++) {
+		r = open_tm(bdev, sm, BM_BLOCK_SIZE, RO_CACHE_SIZE,
+			    &readers[i].bm, &readers[i].tm);
+		if (r < 0) {
+			nr_readers = i;
+			goto out_readers;
+		}
+
+		readers[i].root = root;
+		readers[i].index = i;
+	}
+
+	r = run_readers(readers, nr_readers, NULL, &alone);
+	if (r < 0)
+		goto out_readers;
+
+	r = run_readers(readers, nr_readers, &info, &with_writer);
+	if (r < 0)
+		goto out_readers;
+
+	printk(KERN_ALERT "%u readers: %llu lookups/sec alone, %llu lookups/sec with a writer\n",
+	       nr_readers, alone, with_writer);
+
+out_readers:
+	for (i = 0; i < nr_readers; i++)
+		close_tm(readers[i].bm, readers[i].tm);
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Builds the same 1M key tree with one dm_btree_insert() per key, and
+ * with a bulk load, and compares time and footprint.
+ */
+#define BULK_NR_KEYS 1000000
+#define BULK_NR_BLOCKS 16384
+#define BULK_CACHE_SIZE 1024
+
+struct identity_stream {
+	uint64_t next_key;
+	uint64_t nr_keys;
+};
+
+static int next_identity(void *context, uint64_t *key, void *value)
+{
+	struct identity_stream *s = context;
+
+	if (s->next_key == s->nr_keys)
+		return -ENODATA;
+
+	*key = s->next_key++;
+	*((uint64_t *) value) = *key;
+	return 0;
+}
+
+static int bench_bulk_load(struct block_device *bdev)
+{
+	int r;
+	uint64_t key, value;
+	unsigned depth_inserted, depth_loaded;
+	dm_block_t inserted_root, loaded_root, nr_free_before, nr_free_between, nr_free_after;
+	s64 insert_us, load_us;
+	ktime_t start;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+	struct identity_stream stream;
+
+	sm = dm_sm_core_create(BULK_NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, BULK_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = dm_sm_get_nr_free(sm, &nr_free_before);
+	if (r < 0)
+		goto out;
+
+	start = ktime_get();
+	r = populate_identity(&info, BULK_NR_KEYS, &inserted_root);
+	if (r < 0)
+		goto out;
+	insert_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	r = dm_sm_get_nr_free(sm, &nr_free_between);
+	if (r < 0)
+		goto out;
+
+	stream.next_key = 0;
+	stream.nr_keys = BULK_NR_KEYS;
+
+	start = ktime_get();
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+
+	r = dm_btree_bulk_load(&info, next_identity, &stream, &loaded_root);
+	if (r < 0) {
+		printk(KERN_ALERT "dm_btree_bulk_load failed");
+		dm_tm_unlock(tm, superblock);
+		goto out;
+	}
+	commit(tm, superblock);
+	load_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	r = dm_sm_get_nr_free(sm, &nr_free_after);
+	if (r < 0)
+		goto out;
+
+	for (key = 0; key < BULK_NR_KEYS; key += 97) {
+		r = dm_btree_lookup(&info, loaded_root, &key, &value);
+		if (r < 0 || value != key) {
+			printk(KERN_ALERT "bulk loaded tree is missing key %llu",
+			       (unsigned long long) key);
+			r = -1;
+			goto out;
+		}
+	}
+
+	key = BULK_NR_KEYS;
+	if (dm_btree_lookup(&info, loaded_root, &key, &value) != -ENODATA) {
+		printk(KERN_ALERT "bulk loaded tree has an extra key");
+		r = -1;
+		goto out;
+	}
+
+	r = tree_depth(tm, inserted_root, &depth_inserted);
+	if (r < 0)
+		goto out;
+
+	r = tree_depth(tm, loaded_root, &depth_loaded);
+	if (r < 0)
+		goto out;
+
+	printk(KERN_ALERT "insert: %llu keys/sec, depth %u, %llu blocks",
+	       per_sec(BULK_NR_KEYS, insert_us), depth_inserted,
+	       (unsigned long long) (nr_free_before - nr_free_between));
+	printk(KERN_ALERT "bulk load: %llu keys/sec, depth %u, %llu blocks",
+	       per_sec(BULK_NR_KEYS, load_us), depth_loaded,
+	       (unsigned long long) (nr_free_between - nr_free_after));
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Visits every key in order, first with one dm_btree_lookup() per key
+ * and then with a cursor, and checks a cursor can start part way.
+ */
+#define SCAN_NR_KEYS 100000
+#define SCAN_NR_BLOCKS 4096
+#define SCAN_CACHE_SIZE 1024
+
+static int bench_cursor_scan(struct block_device *bdev)
+{
+	int r;
+	uint64_t key, expected, value;
+	dm_block_t root;
+	s64 lookup_us, cursor_us;
+	ktime_t start;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_btree_cursor c;
+
+	sm = dm_sm_core_create(SCAN_NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, SCAN_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = populate_identity(&info, SCAN_NR_KEYS, &root);
+	if (r < 0)
+		goto out;
+
+	start = ktime_get();
+	for (key = 0; key < SCAN_NR_KEYS; key++) {
+		r = dm_btree_lookup(&info, root, &key, &value);
+		if (r < 0 || value != key) {
+			printk(KERN_ALERT "dm_btree_lookup failed");
+			r = -1;
+			goto out;
+		}
+	}
+	lookup_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	expected = 0;
+	r = dm_btree_cursor_begin(&info, root, 0, &c);
+	while (r == 0) {
+		dm_btree_cursor_get(&c, &key, &value);
+		if (key != expected || value != key) {
+			printk(KERN_ALERT "cursor at key %llu, expected %llu",
+			       (unsigned long long) key, (unsigned long long) expected);
+			dm_btree_cursor_end(&c);
+			r = -1;
+			goto out;
+		}
+
+		expected++;
+		r = dm_btree_cursor_next(&c);
+	}
+	cursor_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	if (r != -ENODATA)
+		goto out;
+
+	if (expected != SCAN_NR_KEYS) {
+		printk(KERN_ALERT "cursor stopped after %llu keys",
+		       (unsigned long long) expected);
+		r = -1;
+		goto out;
+	}
+
+	r = dm_btree_cursor_begin(&info, root, SCAN_NR_KEYS / 2, &c);
+	if (r < 0)
+		goto out;
+
+	dm_btree_cursor_get(&c, &key, &value);
+	dm_btree_cursor_end(&c);
+	if (key != SCAN_NR_KEYS / 2) {
+		printk(KERN_ALERT "cursor didn't start at the requested key");
+		r = -1;
+		goto out;
+	}
+
+	if (dm_btree_cursor_begin(&info, root, SCAN_NR_KEYS, &c) != -ENODATA) {
+		printk(KERN_ALERT "cursor found a key past the end");
+		r = -1;
+		goto out;
+	}
+
+	printk(KERN_ALERT "point lookups: %llu keys/sec, cursor: %llu keys/sec",
+	       per_sec(SCAN_NR_KEYS, lookup_us), per_sec(SCAN_NR_KEYS, cursor_us));
+	r = 0;
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Provisioning style bursts of consecutive keys, written in a shuffled
+ * burst order.  Each burst goes in with one dm_btree_insert() per key,
+ * then with dm_btree_insert_sorted() one key at a time, which shadows
+ * the same paths and gives us a shadow count for single inserts, and
+ * finally with dm_btree_insert_sorted() a burst at a time.
+ */
+#define BATCH_SIZE 256
+#define BATCH_NR_BURSTS 64
+#define BATCH_CACHE_SIZE 256
+
+enum batch_mode {
+	BATCH_INSERT,
+	BATCH_SORTED_SINGLE,
+	BATCH_SORTED_BURST
+};
+
+static int insert_bursts(struct dm_btree_info *info, enum batch_mode mode,
+			 unsigned *order, dm_block_t *root,
+			 struct dm_btree_insert_stats *stats)
+{
+	int r;
+	unsigned burst, i;
+	static uint64_t keys[BATCH_SIZE], values[BATCH_SIZE];
+
+	for (burst = 0; burst < BATCH_NR_BURSTS; burst++) {
+		for (i = 0; i < BATCH_SIZE; i++) {
+			keys[i] = order[burst] * BATCH_SIZE + i;
+			values[i] = keys[i] * 3;
+		}
+
+		switch (mode) {
+		case BATCH_INSERT:
+			for (i = 0; i < BATCH_SIZE; i++) {
+				r = dm_btree_insert(info, *root, keys + i, values + i, root);
+				if (r < 0)
+					return r;
+			}
+			break;
+
+		case BATCH_SORTED_SINGLE:
+			for (i = 0; i < BATCH_SIZE; i++) {
+				r = dm_btree_insert_sorted(info, *root, keys + i, values + i,
+							   1, root, stats);
+				if (r < 0)
+					return r;
+			}
+			break;
+
+		case BATCH_SORTED_BURST:
+			r = dm_btree_insert_sorted(info, *root, keys, values,
+						   BATCH_SIZE, root, stats);
+			if (r < 0)
+				return r;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_one_batch_mode(struct dm_btree_info *info, enum batch_mode mode,
+				unsigned *order, const char *desc)
+{
+	int r;
+	uint64_t key, value;
+	dm_block_t root;
+	s64 us;
+	ktime_t start;
+	struct dm_block *superblock;
+	struct dm_btree_insert_stats stats = { 0, 0, 0 };
+
+	r = begin(info->tm, &superblock);
+	if (r < 0)
+		return r;
+
+	r = dm_btree_empty(info, &root);
+	if (r < 0)
+		goto bad;
+
+	start = ktime_get();
+	r = insert_bursts(info, mode, order, &root, &stats);
+	if (r < 0) {
+		printk(KERN_ALERT "%s failed", desc);
+		goto bad;
+	}
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	commit(info->tm, superblock);
+
+	for (key = 0; key < BATCH_SIZE * BATCH_NR_BURSTS; key++) {
+		r = dm_btree_lookup(info, root, &key, &value);
+		if (r < 0 || value != key * 3) {
+			printk(KERN_ALERT "%s lost key %llu", desc, (unsigned long long) key);
+			return -1;
+		}
+	}
+
+	if (mode == BATCH_INSERT)
+		printk(KERN_ALERT "%s: %llu inserts/sec", desc,
+		       per_sec(BATCH_SIZE * BATCH_NR_BURSTS, us));
+	else
+		printk(KERN_ALERT "%s: %llu inserts/sec, %lu descents, %lu shadows, %lu leaf splits",
+		       desc, per_sec(BATCH_SIZE * BATCH_NR_BURSTS, us),
+		       stats.descents, stats.shadows, stats.full_leaves);
+
+	return 0;
+
+bad:
+	dm_tm_unlock(info->tm, superblock);
+	return r;
+}
+
+static int bench_batched_insert(struct block_device *bdev)
+{
+	int r;
+	unsigned i;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	static unsigned order[BATCH_NR_BURSTS];
+
+	for (i = 0; i < BATCH_NR_BURSTS; i++)
+		order[i] = i;
+	shuffle(order, BATCH_NR_BURSTS);
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, BATCH_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = bench_one_batch_mode(&info, BATCH_INSERT, order, "dm_btree_insert");
+	if (r < 0)
+		goto out;
+
+	r = bench_one_batch_mode(&info, BATCH_SORTED_SINGLE, order, "sorted insert, 1 key");
+	if (r < 0)
+		goto out;
+
+	r = bench_one_batch_mode(&info, BATCH_SORTED_BURST, order, "sorted insert, whole burst");
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Sequential and random lookups over a warm tree, with dm_btree_lookup(),
+ * and with dm_btree_lookup_cached() without and with a context.
+ */
+#define FINGER_NR_KEYS 100000
+#define FINGER_LOOKUPS 100000
+
+static int finger_pass(struct dm_btree_info *info, dm_block_t root,
+		       int sequential, int cached, struct dm_btree_lookup_ctx *ctx,
+		       s64 *us)
+{
+	int r = 0;
+	unsigned i;
+	uint64_t key, value;
+	ktime_t start;
+
+	if (ctx)
+		dm_btree_lookup_ctx_init(ctx);
+
+	start = ktime_get();
+	for (i = 0; i < FINGER_LOOKUPS; i++) {
+		key = sequential ? i % FINGER_NR_KEYS : random(FINGER_NR_KEYS);
+		if (cached)
+			r = dm_btree_lookup_cached(info, root, key, &value, ctx);
+		else
+			r = dm_btree_lookup(info, root, &key, &value);
+
+		if (r < 0 || value != key) {
+			printk(KERN_ALERT "lookup of %llu failed", (unsigned long long) key);
+			return -1;
+		}
+	}
+	*us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	return 0;
+}
+
+static int bench_finger_lookups(struct block_device *bdev)
+{
+	int r, sequential;
+	dm_block_t root;
+	s64 plain_us, no_ctx_us, ctx_us;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_btree_lookup_ctx ctx;
+
+	sm = dm_sm_core_create(SCAN_NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, SCAN_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = populate_identity(&info, FINGER_NR_KEYS, &root);
+	if (r < 0)
+		goto out;
+
+	for (sequential = 1; sequential >= 0; sequential--) {
+		r = finger_pass(&info, root, sequential, 0, NULL, &plain_us);
+		if (r < 0)
+			goto out;
+
+		r = finger_pass(&info, root, sequential, 1, NULL, &no_ctx_us);
+		if (r < 0)
+			goto out;
+
+		r = finger_pass(&info, root, sequential, 1, &ctx, &ctx_us);
+		if (r < 0)
+			goto out;
+
+		printk(KERN_ALERT "%s: dm_btree_lookup %llu/sec, no context %llu/sec, context %llu/sec (%lu node reads per 100 lookups)",
+		       sequential ? "sequential" : "random",
+		       per_sec(FINGER_LOOKUPS, plain_us),
+		       per_sec(FINGER_LOOKUPS, no_ctx_us),
+		       per_sec(FINGER_LOOKUPS, ctx_us),
+		       ctx.node_reads * 100 / ctx.lookups);
+	}
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Times the two in-node searches on a copy of a full leaf, then whole
+ * lookups over a fully cached tree through dm_btree_lookup_search() with
+ * each of them.  The keys probed are chosen before the clock starts.
+ */
+#define SEARCH_NR_KEYS 100000
+#define SEARCH_ITERATIONS 1000000
+#define SEARCH_LOOKUPS 200000
+#define SEARCH_PROBES 4096	/* power of 2 */
+
+static void fill_probes(uint64_t *probes, unsigned limit)
+{
+	unsigned i;
+
+	for (i = 0; i < SEARCH_PROBES; i++)
+		probes[i] = random(limit);
+}
+
+static s64 time_search(dm_btree_search_fn fn, struct node *n, uint64_t *probes)
+{
+	unsigned i;
+	int total = 0;
+	ktime_t start;
+	s64 us;
+
+	start = ktime_get();
+	for (i = 0; i < SEARCH_ITERATIONS; i++)
+		total += fn(n, probes[i & (SEARCH_PROBES - 1)]);
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	/* keep the searches from being optimised away */
+	if (total == -1)
+		printk(KERN_ALERT "unlikely total");
+
+	return div_s64(us * NSEC_PER_USEC, SEARCH_ITERATIONS);
+}
+
+static int time_lookups(struct dm_btree_info *info, dm_block_t root,
+			dm_btree_search_fn fn, uint64_t *probes, s64 *ns)
+{
+	int r;
+	unsigned i;
+	uint64_t value;
+	ktime_t start;
+	s64 us;
+
+	start = ktime_get();
+	for (i = 0; i < SEARCH_LOOKUPS; i++) {
+		r = dm_btree_lookup_search(info, root, probes[i & (SEARCH_PROBES - 1)],
+					   &value, fn);
+		if (r < 0)
+			return r;
+	}
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	*ns = div_s64(us * NSEC_PER_USEC, SEARCH_LOOKUPS);
+	return 0;
+}
+
+static int bench_node_search(struct block_device *bdev)
+{
+	int r;
+	unsigned nr_keys;
+	uint64_t key, value, *probes = NULL;
+	dm_block_t root, b;
+	s64 binary_ns, branchless_ns;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock, *block;
+	struct identity_stream stream;
+	struct node *n, *leaf = NULL;
+
+	sm = dm_sm_core_create(SCAN_NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, SCAN_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	stream.next_key = 0;
+	stream.nr_keys = SEARCH_NR_KEYS;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+
+	r = dm_btree_bulk_load(&info, next_identity, &stream, &root);
+	if (r < 0) {
+		dm_tm_unlock(tm, superblock);
+		goto out;
+	}
+	commit(tm, superblock);
+
+	/* take a copy of the leftmost leaf, which is full */
+	leaf = kmalloc(BM_BLOCK_SIZE, GFP_KERNEL);
+	probes = kmalloc(sizeof(*probes) * SEARCH_PROBES, GFP_KERNEL);
+	if (!leaf || !probes) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	b = root;
+	for (;;) {
+		r = dm_tm_read_lock(tm, b, &block);
+		if (r < 0)
+			goto out;
+
+		n = dm_block_data(block);
+		if (!(le32_to_cpu(n->header.flags) & INTERNAL_NODE))
+			break;
+
+		b = le64_to_cpu(n->keys[le32_to_cpu(n->header.max_entries)]);
+		dm_tm_unlock(tm, block);
+	}
+	memcpy(leaf, n, BM_BLOCK_SIZE);
+	dm_tm_unlock(tm, block);
+	nr_keys = le32_to_cpu(leaf->header.nr_entries);
+
+	fill_probes(probes, nr_keys);
+	printk(KERN_ALERT "%u key leaf: binary search %lld ns, branchless %lld ns",
+	       nr_keys,
+	       time_search(dm_btree_node_search_binary, leaf, probes),
+	       time_search(dm_btree_node_search, leaf, probes));
+
+	/* warm the cache */
+	for (key = 0; key < SEARCH_NR_KEYS; key++) {
+		r = dm_btree_lookup(&info, root, &key, &value);
+		if (r < 0)
+			goto out;
+	}
+
+	fill_probes(probes, SEARCH_NR_KEYS);
+	r = time_lookups(&info, root, dm_btree_node_search_binary, probes, &binary_ns);
+	if (r < 0)
+		goto out;
+
+	r = time_lookups(&info, root, dm_btree_node_search, probes, &branchless_ns);
+	if (r < 0)
+		goto out;
+
+	printk(KERN_ALERT "cached tree: binary search %lld ns/lookup, branchless %lld ns/lookup",
+	       binary_ns, branchless_ns);
+
+out:
+	kfree(probes);
+	kfree(leaf);
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Removes the same 1M entries from two copies of a bulk loaded tree, one
+ * key at a time and as a single range, counting the values released
+ * through value_type.del.
+ */
+#define RANGE_NR_KEYS 1100000
+#define RANGE_BEGIN 50000
+#define RANGE_END (RANGE_BEGIN + 1000000)
+#define RANGE_NR_BLOCKS 32768
+
+static void count_del(void *context, void *value)
+{
+	(*((uint64_t *) context))++;
+}
+
+static int build_range_tree(struct dm_btree_info *info, dm_block_t *root)
+{
+	int r;
+	struct dm_block *superblock;
+	struct identity_stream stream;
+
+	stream.next_key = 0;
+	stream.nr_keys = RANGE_NR_KEYS;
+
+	r = begin(info->tm, &superblock);
+	if (r < 0)
+		return r;
+
+	r = dm_btree_bulk_load(info, next_identity, &stream, root);
+	if (r < 0) {
+		dm_tm_unlock(info->tm, superblock);
+		return r;
+	}
+	commit(info->tm, superblock);
+
+	return 0;
+}
+
+/*
+ * Counts what's left with a cursor, and spot checks either side of the
+ * removed range.
+ */
+static int check_range_removed(struct dm_btree_info *info, dm_block_t root)
+{
+	int r;
+	uint64_t key, value, count = 0;
+	struct dm_btree_cursor c;
+
+	r = dm_btree_cursor_begin(info, root, 0, &c);
+	while (r == 0) {
+		count++;
+		r = dm_btree_cursor_next(&c);
+	}
+
+	if (r != -ENODATA)
+		return r;
+
+	if (count != RANGE_NR_KEYS - (RANGE_END - RANGE_BEGIN)) {
+		printk(KERN_ALERT "%llu keys left", (unsigned long long) count);
+		return -1;
+	}
+
+	key = RANGE_BEGIN - 1;
+	if (dm_btree_lookup(info, root, &key, &value) < 0)
+		return -1;
+
+	key = RANGE_END;
+	if (dm_btree_lookup(info, root, &key, &value) < 0)
+		return -1;
+
+	key = RANGE_BEGIN;
+	if (dm_btree_lookup(info, root, &key, &value) != -ENODATA)
+		return -1;
+
+	key = RANGE_END - 1;
+	if (dm_btree_lookup(info, root, &key, &value) != -ENODATA)
+		return -1;
+
+	return 0;
+}
+
+static int bench_range_remove(struct block_device *bdev)
+{
+	int r;
+	uint64_t key, nr_del = 0;
+	dm_block_t root;
+	s64 per_key_us, range_us;
+	ktime_t start;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+
+	sm = dm_sm_core_create(RANGE_NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	r = open_tm(bdev, sm, BM_BLOCK_SIZE, BULK_CACHE_SIZE, &bm, &tm);
+	if (r < 0) {
+		dm_sm_destroy(sm);
+		return r;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.context = &nr_del;
+	info.value_type.copy = NULL;
+	info.value_type.del = count_del;
+	info.value_type.equal = NULL;
+
+	/* one key at a time */
+	r = build_range_tree(&info, &root);
+	if (r < 0)
+		goto out;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+
+	start = ktime_get();
+	for (key = RANGE_BEGIN; key < RANGE_END; key++) {
+		r = dm_btree_remove(&info, root, &key, &root);
+		if (r < 0) {
+			printk(KERN_ALERT "dm_btree_remove failed");
+			dm_tm_unlock(tm, superblock);
+			goto out;
+		}
+	}
+	commit(tm, superblock);
+	per_key_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	r = check_range_removed(&info, root);
+	if (r < 0)
+		goto out;
+
+	printk(KERN_ALERT "per key removal: %lld us, %llu values released",
+	       per_key_us, (unsigned long long) nr_del);
+
+	/* the same as a range */
+	r = build_range_tree(&info, &root);
+	if (r < 0)
+		goto out;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+
+	nr_del = 0;
+	start = ktime_get();
+	r = dm_btree_remove_range(&info, root, RANGE_BEGIN, RANGE_END, &root);
+	if (r < 0) {
+		printk(KERN_ALERT "dm_btree_remove_range failed");
+		dm_tm_unlock(tm, superblock);
+		goto out;
+	}
+	commit(tm, superblock);
+	range_us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	r = check_range_removed(&info, root);
+	if (r < 0)
+		goto out;
+
+	if (nr_del != RANGE_END - RANGE_BEGIN) {
+		printk(KERN_ALERT "range removal released %llu values",
+		       (unsigned long long) nr_del);
+		r = -1;
+		goto out;
+	}
+
+	printk(KERN_ALERT "range removal: %lld us, %llu values released",
+	       range_us, (unsigned long long) nr_del);
+
+out:
+	close_tm(bm, tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*
+ * Abandons the current transaction.  The transaction manager has no
+ * abort of its own, so we drop the superblock lock, roll the space map
+ * back to the checkpoint taken at begin, and replace the transaction
+ * manager so it forgets which blocks it has shadowed.  Shadows and new
+ * blocks from the abandoned transaction may still be in the cache, but
+ * they're all in blocks that are free again.  The caller goes back to
+ * the last committed root.
+ */
+static int abort_transaction(struct dm_block_manager *bm,
+			     struct dm_space_map *sm,
+			     struct dm_transaction_manager **tm,
+			     struct dm_block *superblock)
+{
+	int r;
+
+	r = dm_bm_unlock(superblock);
+	if (r < 0)
+		return r;
+
+	r = dm_sm_core_rollback(sm);
+	if (r < 0)
+		return r;
+
+	dm_tm_destroy(*tm);
+	*tm = dm_tm_create(bm, sm);
+	return *tm ? 0 : -ENOMEM;
+}
+
+/*
+ * Makes a random batch of inserts and removes in each transaction, then
+ * randomly commits or aborts it, and checks the tree and space map
+ * match the last commit.  Rolling back needs a space map we can
+ * checkpoint, so this builds its own transaction manager over the
+ * block manager it's given.
+ */
+#define ABORT_ROUNDS 100
+#define ABORT_OPS 50
+#define ABORT_KEY_SPACE 2000
+
+struct model {
+	uint8_t present[ABORT_KEY_SPACE];
+	uint64_t values[ABORT_KEY_SPACE];
+};
+
+static int check_against_model(struct dm_btree_info *info, dm_block_t root,
+			       struct model *m)
+{
+	int r;
+	uint64_t key, value;
+
+	for (key = 0; key < ABORT_KEY_SPACE; key++) {
+		r = dm_btree_lookup(info, root, &key, &value);
+		if (m->present[key]) {
+			if (r < 0) {
+				printk(KERN_ALERT "key %u missing", (unsigned) key);
+				return r;
+			}
+
+			if (value != m->values[key]) {
+				printk(KERN_ALERT "key %u has the wrong value", (unsigned) key);
+				return -1;
+			}
+
+		} else if (r != -ENODATA) {
+			printk(KERN_ALERT "key %u unexpectedly present", (unsigned) key);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_random_aborts(struct dm_transaction_manager *test_tm)
+{
+	int r;
+	unsigned round, op;
+	uint64_t key, value;
+	dm_block_t root = 0, committed_root, sb, nr_free, committed_nr_free;
+	struct dm_btree_info info;
+	struct dm_space_map *sm;
+	struct dm_block_manager *bm = dm_tm_get_bm(test_tm);
+	struct dm_transaction_manager *tm;
+	struct dm_block *superblock;
+	static struct model committed, pending;
+
+	memset(&committed, 0, sizeof(committed));
+
+	sm = dm_sm_core_create(NR_BLOCKS);
+	if (!sm)
+		return -ENOMEM;
+
+	tm = dm_tm_create(bm, sm);
+	if (!tm) {
+		dm_sm_destroy(sm);
+		return -ENOMEM;
+	}
+
+	info.tm = tm;
+	info.levels = 1;
+	info.value_type.size = sizeof(uint64_t);
+	info.value_type.copy = NULL;
+	info.value_type.del = NULL;
+	info.value_type.equal = NULL;
+
+	r = begin(tm, &superblock);
+	if (r < 0)
+		goto out;
+	sb = dm_block_location(superblock);
+
+	r = dm_btree_empty(&info, &root);
+	if (r < 0)
+		goto out;
+	commit(tm, superblock);
+	committed_root = root;
+
+	r = dm_sm_get_nr_free(sm, &committed_nr_free);
+	if (r < 0)
+		goto out;
+
+	for (round = 0; round < ABORT_ROUNDS; round++) {
+		r = begin_again(tm, sb, &superblock);
+		if (r < 0)
+			goto out;
+
+		r = dm_sm_core_checkpoint(sm);
+		if (r < 0)
+			goto out;
+
+		pending = committed;
+		for (op = 0; op < ABORT_OPS; op++) {
+			key = random(ABORT_KEY_SPACE);
+			if (random(3)) {
+				value = key * 3 + round;
+				r = dm_btree_insert(&info, root, &key, &value, &root);
+				pending.present[key] = 1;
+				pending.values[key] = value;
+
+			} else {
+				r = dm_btree_remove(&info, root, &key, &root);
+				if (r == -ENODATA && !pending.present[key])
+					r = 0;
+				pending.present[key] = 0;
+			}
+
+			if (r < 0) {
+				printk(KERN_ALERT "op %u in round %u failed", op, round);
+				goto out;
+			}
+		}
+
+		r = check_against_model(&info, root, &pending);
+		if (r < 0)
+			goto out;
+
+		if (random(2)) {
+			r = abort_transaction(bm, sm, &tm, superblock);
+			if (r < 0)
+				goto out;
+
+			info.tm = tm;
+			root = committed_root;
+
+			r = dm_sm_get_nr_free(sm, &nr_free);
+			if (r < 0)
+				goto out;
+
+			if (nr_free != committed_nr_free) {
+				printk(KERN_ALERT "space map not rolled back");
+				r = -1;
+				goto out;
+			}
+
+		} else {
+			commit(tm, superblock);
+			committed_root = root;
+			committed = pending;
+
+			r = dm_sm_get_nr_free(sm, &committed_nr_free);
+			if (r < 0)
+				goto out;
+		}
+
+		r = check_against_model(&info, root, &committed);
+		if (r < 0)
+			goto out;
+	}
+
+out:
+	if (tm)
+		dm_tm_destroy(tm);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+static int run_test(const char *name, test_fn fn)
+{
+	int r;
+	struct dm_space_map *sm = dm_sm_core_create(NR_BLOCKS);
+	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode, &run_test);
+	struct dm_block_manager *bm;
+	struct dm_transaction_manager *tm;
+	ktime_t start;
+
+	if (IS_ERR(bdev))
+		return -1;
+
+	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	if (!bm)
+		return -1;
+
+	tm = dm_tm_create(bm, sm);
+	if (!tm)
+		return -1;
+
+	printk(KERN_ALERT "running %s ... ", name);
+	start = ktime_get();
+	r = fn(tm);
+	printk(KERN_ALERT "%s (%lld us)\n", r == 0 ? "pass" : "fail",
+	       ktime_to_us(ktime_sub(ktime_get(), start)));
+
+	dm_tm_destroy(tm);
+	dm_block_manager_destroy(bm);
+	blkdev_put(bdev, mode);
+	dm_sm_destroy(sm);
+	return r;
+}
+
+static int run_bench(const char *name, bench_fn fn)
+{
+	int r;
+	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode, &run_bench);
+
+	if (IS_ERR(bdev))
+		return -1;
+
+	printk(KERN_ALERT "running %s ... ", name);
+	r = fn(bdev);
+	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
+
+	blkdev_put(bdev, mode);
+	return r;
+}
+
+static int btree_test_init(void)
+{
+	static struct {
+		const char *name;
+		test_fn fn;
+	} table_[] = {
+		{"lookup in an empty btree", check_lookup_empty},
+		{"check insert", check_insert},
+		{"check insert, commit every 100", check_multiple_commits},
+		{"check hierarchical insert", check_insert_h},
+		{"insert one, remove one", check_remove_one},
+		{"insert many, remove one", check_removal_with_internal_nodes},
+		{"insert many, remove one, hierarchical", check_removal_in_hierarchy},
+		{"repeated insert/remove linear order", check_insert_remove_many},
+		{"repeated insert/remove linear order", check_insert_remove_many_reverse},
+		{"repeated insert/remove random order", check_insert_remove_many_random},
+		{"repeated insert/remove center order", check_insert_remove_many_center},
+		{"lookup next/prev in a sparse tree", check_lookup_nearest},
+		{"random aborts leave the committed tree intact", check_random_aborts},
+	};
+
+	static struct {
+		const char *name;
+		bench_fn fn;
+	} bench_table_[] = {
+		{"insert throughput while resizing the cache", bench_insert_resizing_cache},
+		{"btree shape and throughput by metadata block size", bench_block_sizes},
+		{"lookup storm", bench_lookup_storm},
+		{"lookups pinned to each numa node in turn", bench_numa_lookups},
+		{"readers of a committed tree alongside a writer", bench_readers_and_writer},
+		{"periodic commits, synchronous vs pipelined bound", bench_commit_intervals},
+		{"bulk load vs incremental insert", bench_bulk_load},
+		{"full scan, cursor vs point lookups", bench_cursor_scan},
+		{"batched vs single inserts", bench_batched_insert},
+		{"sequential and random lookups with a finger", bench_finger_lookups},
+		{"in-node search, binary vs branchless", bench_node_search},
+		{"range removal vs per key removal", bench_range_remove},
+	};
+
+	int i, failed = 0;
+
+	for (i = 0; i < sizeof(table_) / sizeof(*table_); i++)
+		if (run_test(table_[i].name, table_[i].fn))
+			failed++;
+
+	printk(KERN_ALERT "running benchmarks");
+	for (i = 0; i < sizeof(bench_table_) / sizeof(*bench_table_); i++)
+		if (run_bench(bench_table_[i].name, bench_table_[i].fn))
+			failed++;
+
+	if (failed) {
+		printk(KERN_ALERT "%d btree tests or benchmarks failed", failed);
+		return -EINVAL;
+	}
 
 	return 0;
 }
@@ -0,0 +1,371 @@
+#include "dm-block-manager-trace.h"
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+/*----------------------------------------------------------------*/
+
+struct trace_ring {
+	spinlock_t lock;
+	unsigned head;		/* next slot to be written */
+	unsigned count;
+	unsigned long overwritten;
+	struct dm_bm_trace_event *events;
+};
+
+struct dm_bm_trace {
+	unsigned nr_events;
+	struct trace_ring __percpu *rings;
+	struct dentry *file;
+};
+
+static void record(struct dm_bm_trace *t, uint32_t op, dm_block_t b,
+		   int result, ktime_t start)
+{
+	unsigned long flags;
+	struct trace_ring *ring;
+	struct dm_bm_trace_event *e;
+	ktime_t end = ktime_get();
+
+	ring = per_cpu_ptr(t->rings, get_cpu());
+	spin_lock_irqsave(&ring->lock, flags);
+
+	e = ring->events + ring->head;
+	e->time_ns = ktime_to_ns(start);
+	e->duration_ns = ktime_to_ns(ktime_sub(end, start));
+	e->block = b;
+	e->op = op;
+	e->result = result;
+
+	ring->head = (ring->head + 1) % t->nr_events;
+	if (ring->count < t->nr_events)
+		ring->count++;
+	else
+		ring->overwritten++;
+
+	spin_unlock_irqrestore(&ring->lock, flags);
+	put_cpu();
+}
+
+/*
+ * Fetches the |index|th oldest event still in a cpu's ring.
+ */
+static int peek(struct dm_bm_trace *t, int cpu, unsigned index,
+		struct dm_bm_trace_event *e)
+{
+	int r = 0;
+	unsigned long flags;
+	struct trace_ring *ring = per_cpu_ptr(t->rings, cpu);
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (index < ring->count) {
+		*e = ring->events[(ring->head + t->nr_events - ring->count + index) %
+				  t->nr_events];
+		r = 1;
+	}
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	return r;
+}
+
+/*
+ * Walks the events still in the rings, merged across cpus into time
+ * order.  |taken| counts the events already returned from each cpu.
+ */
+struct trace_iter {
+	struct dm_bm_trace *t;
+	loff_t pos;		/* events returned so far */
+	struct dm_bm_trace_event e;
+	unsigned taken[0];
+};
+
+static struct trace_iter *iter_alloc(struct dm_bm_trace *t)
+{
+	struct trace_iter *it;
+
+	it = kzalloc(sizeof(*it) + sizeof(*it->taken) * nr_cpu_ids, GFP_KERNEL);
+	if (it)
+		it->t = t;
+
+	return it;
+}
+
+static void iter_reset(struct trace_iter *it)
+{
+	it->pos = 0;
+	memset(it->taken, 0, sizeof(*it->taken) * nr_cpu_ids);
+}
+
+/*
+ * Moves on to the next event, leaving it in it->e.  Returns 0 once there
+ * are no more.
+ */
+static int iter_next(struct trace_iter *it)
+{
+	int cpu, best = -1;
+	struct dm_bm_trace_event e;
+
+	for_each_possible_cpu(cpu) {
+		if (!peek(it->t, cpu, it->taken[cpu], &e))
+			continue;
+
+		if (best < 0 || e.time_ns < it->e.time_ns) {
+			best = cpu;
+			it->e = e;
+		}
+	}
+
+	if (best < 0)
+		return 0;
+
+	it->taken[best]++;
+	it->pos++;
+	return 1;
+}
+
+/*
+ * Events recorded but not returned by |it|, including those overwritten
+ * when a ring wrapped.  |it| may be NULL, in which case nothing has been
+ * returned.
+ */
+static unsigned long nr_lost(struct dm_bm_trace *t, struct trace_iter *it)
+{
+	int cpu;
+	unsigned taken;
+	unsigned long flags, lost = 0;
+	struct trace_ring *ring;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(t->rings, cpu);
+		taken = it ? it->taken[cpu] : 0;
+
+		spin_lock_irqsave(&ring->lock, flags);
+		lost += ring->overwritten;
+		if (ring->count > taken)
+			lost += ring->count - taken;
+		spin_unlock_irqrestore(&ring->lock, flags);
+	}
+
+	return lost;
+}
+
+unsigned dm_bm_trace_copy(struct dm_bm_trace *t, struct dm_bm_trace_event *events,
+			  unsigned max, unsigned long *lost)
+{
+	unsigned n = 0;
+	struct trace_iter *it = iter_alloc(t);
+
+	if (it)
+		while (n < max && iter_next(it))
+			events[n++] = it->e;
+
+	if (lost)
+		*lost = nr_lost(t, it);
+
+	kfree(it);
+	return n;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_copy);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * The debugfs file has one event per line, oldest first:
+ * time_ns duration_ns op block result
+ * Lines are formatted as they're read, so events recorded meanwhile may
+ * show up too.
+ */
+static const char *op_names[] = {
+	"read_lock",
+	"write_lock",
+	"unlock",
+	"flush_and_unlock"
+};
+
+static void *trace_start(struct seq_file *m, loff_t *pos)
+{
+	struct trace_iter *it = m->private;
+
+	/* the event at *pos is the last one returned if it->pos == *pos + 1 */
+	if (it->pos > *pos + 1)
+		iter_reset(it);
+
+	while (it->pos < *pos + 1)
+		if (!iter_next(it))
+			return NULL;
+
+	return it;
+}
+
+static void *trace_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct trace_iter *it = v;
+
+	++*pos;
+	return iter_next(it) ? it : NULL;
+}
+
+static void trace_stop(struct seq_file *m, void *v)
+{
+}
+
+static int trace_show(struct seq_file *m, void *v)
+{
+	struct trace_iter *it = v;
+
+	seq_printf(m, "%llu %llu %s %llu %d\n",
+		   (unsigned long long) it->e.time_ns,
+		   (unsigned long long) it->e.duration_ns,
+		   op_names[it->e.op],
+		   (unsigned long long) it->e.block,
+		   it->e.result);
+	return 0;
+}
+
+static const struct seq_operations trace_seq_ops = {
+	.start = trace_start,
+	.next = trace_next,
+	.stop = trace_stop,
+	.show = trace_show
+};
+
+static int trace_open(struct inode *inode, struct file *file)
+{
+	int r;
+	struct trace_iter *it = iter_alloc(inode->i_private);
+
+	if (!it)
+		return -ENOMEM;
+
+	r = seq_open(file, &trace_seq_ops);
+	if (r) {
+		kfree(it);
+		return r;
+	}
+
+	((struct seq_file *) file->private_data)->private = it;
+	return 0;
+}
+
+static int trace_release(struct inode *inode, struct file *file)
+{
+	kfree(((struct seq_file *) file->private_data)->private);
+	return seq_release(inode, file);
+}
+
+static const struct file_operations trace_fops = {
+	.owner = THIS_MODULE,
+	.open = trace_open,
+	.read = seq_read,
+	.release = trace_release,
+	.llseek = seq_lseek
+};
+
+/*----------------------------------------------------------------*/
+
+struct dm_bm_trace *dm_bm_trace_create(const char *name, unsigned nr_events)
+{
+	int cpu;
+	struct trace_ring *ring;
+	struct dm_bm_trace *t;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+
+	t->nr_events = nr_events;
+	t->rings = alloc_percpu(struct trace_ring);
+	if (!t->rings) {
+		kfree(t);
+		return NULL;
+	}
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(t->rings, cpu);
+		spin_lock_init(&ring->lock);
+		ring->head = 0;
+		ring->count = 0;
+		ring->overwritten = 0;
+		ring->events = vmalloc(sizeof(*ring->events) * nr_events);
+		if (!ring->events) {
+			dm_bm_trace_destroy(t);
+			return NULL;
+		}
+	}
+
+	/* tracing still works without debugfs, it just can't be read there */
+	t->file = debugfs_create_file(name, 0444, NULL, t, &trace_fops);
+
+	return t;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_create);
+
+void dm_bm_trace_destroy(struct dm_bm_trace *t)
+{
+	int cpu;
+
+	if (!IS_ERR_OR_NULL(t->file))
+		debugfs_remove(t->file);
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(t->rings, cpu)->events);
+
+	free_percpu(t->rings);
+	kfree(t);
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_destroy);
+
+/*----------------------------------------------------------------*/
+
+int dm_bm_trace_read_lock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+			  dm_block_t b, struct dm_block **result)
+{
+	ktime_t start = ktime_get();
+	int r = dm_bm_read_lock(bm, b, result);
+
+	record(t, BM_TRACE_READ_LOCK, b, r, start);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_read_lock);
+
+int dm_bm_trace_write_lock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+			   dm_block_t b, struct dm_block **result)
+{
+	ktime_t start = ktime_get();
+	int r = dm_bm_write_lock(bm, b, result);
+
+	record(t, BM_TRACE_WRITE_LOCK, b, r, start);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_write_lock);
+
+int dm_bm_trace_unlock(struct dm_bm_trace *t, struct dm_block *b)
+{
+	dm_block_t location = dm_block_location(b);
+	ktime_t start = ktime_get();
+	int r = dm_bm_unlock(b);
+
+	record(t, BM_TRACE_UNLOCK, location, r, start);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_unlock);
+
+int dm_bm_trace_flush_and_unlock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+				 struct dm_block *superblock)
+{
+	dm_block_t location = dm_block_location(superblock);
+	ktime_t start = ktime_get();
+	int r = dm_bm_flush_and_unlock(bm, superblock);
+
+	record(t, BM_TRACE_FLUSH_AND_UNLOCK, location, r, start);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_bm_trace_flush_and_unlock);
+
+/*----------------------------------------------------------------*/
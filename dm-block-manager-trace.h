@@ -0,0 +1,59 @@
+#ifndef SNAPSHOTS_BLOCK_MANAGER_TRACE_H
+#define SNAPSHOTS_BLOCK_MANAGER_TRACE_H
+
+#include "md/persistent-data/dm-block-manager.h"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Records block manager operations, with timestamps, into per cpu ring
+ * buffers that can be read back through debugfs or copied out for
+ * replay.  Only operations that go through the wrappers below are
+ * seen.  This is only used by test code.
+ */
+enum dm_bm_trace_op {
+	BM_TRACE_READ_LOCK,
+	BM_TRACE_WRITE_LOCK,
+	BM_TRACE_UNLOCK,
+	BM_TRACE_FLUSH_AND_UNLOCK
+};
+
+struct dm_bm_trace_event {
+	uint64_t time_ns;	/* when the call was made */
+	uint64_t duration_ns;
+	dm_block_t block;
+	uint32_t op;
+	int32_t result;
+};
+
+struct dm_bm_trace;
+
+/*
+ * |name| is the file created in the debugfs root, |nr_events| the size
+ * of each cpu's ring.
+ */
+struct dm_bm_trace *dm_bm_trace_create(const char *name, unsigned nr_events);
+void dm_bm_trace_destroy(struct dm_bm_trace *t);
+
+int dm_bm_trace_read_lock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+			  dm_block_t b, struct dm_block **result);
+int dm_bm_trace_write_lock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+			   dm_block_t b, struct dm_block **result);
+int dm_bm_trace_unlock(struct dm_bm_trace *t, struct dm_block *b);
+int dm_bm_trace_flush_and_unlock(struct dm_bm_trace *t, struct dm_block_manager *bm,
+				 struct dm_block *superblock);
+
+/*
+ * Copies out up to |max| of the recorded events, merged across cpus into
+ * time order.  Returns the number copied.  If |lost| isn't NULL it's set
+ * to the number of events missing from the copy, either because a ring
+ * wrapped and overwrote them, because they didn't fit in |max| or
+ * because there wasn't memory to merge the rings.  A trace with events
+ * lost can't be replayed.
+ */
+unsigned dm_bm_trace_copy(struct dm_bm_trace *t, struct dm_bm_trace_event *events,
+			  unsigned max, unsigned long *lost);
+
+/*----------------------------------------------------------------*/
+
+#endif
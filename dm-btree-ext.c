@@ -0,0 +1,1278 @@
+#include "dm-btree-ext.h"
+
+#include "md/persistent-data/dm-btree-internal.h"
+#include "md/persistent-data/dm-transaction-manager.h"
+
+#include <linux/slab.h>
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Node accessors.  Values sit after the full array of max_entries keys.
+ * Internal nodes hold __le64 block numbers as their values.
+ */
+static uint32_t nr_entries(struct node *n)
+{
+	return le32_to_cpu(n->header.nr_entries);
+}
+
+static uint32_t max_entries(struct node *n)
+{
+	return le32_to_cpu(n->header.max_entries);
+}
+
+static void *ext_value_ptr(struct node *n, unsigned index, size_t value_size)
+{
+	return ((uint8_t *) (n->keys + max_entries(n))) + index * value_size;
+}
+
+static uint64_t ext_value64(struct node *n, unsigned index)
+{
+	return le64_to_cpu(*((__le64 *) ext_value_ptr(n, index, sizeof(__le64))));
+}
+
+/*
+ * Both searches return the index of the last key <= |key|, or -1 if
+ * there isn't one.
+ *
+ * This is the usual binary search, which leaves early on a match.  Its
+ * branches go whichever way the key sends them, so they mispredict about
+ * half the time.
+ */
+static int ext_lower_bound_binary(struct node *n, uint64_t key)
+{
+	int lo = -1, hi = nr_entries(n);
+
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		uint64_t mid_key = le64_to_cpu(n->keys[mid]);
+
+		if (mid_key == key)
+			return mid;
+
+		if (mid_key < key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * This one always does log2(nr_entries) steps, and the only thing that
+ * depends on the comparison is which half it keeps, which the compiler
+ * can turn into a conditional move.  The loop branch is predictable, so
+ * the cpu can run ahead and load the next probe early.
+ */
+static int ext_lower_bound(struct node *n, uint64_t key)
+{
+	unsigned nr = nr_entries(n), base = 0, half;
+
+	if (!nr)
+		return -1;
+
+	while (nr > 1) {
+		half = nr / 2;
+		base = le64_to_cpu(n->keys[base + half]) <= key ? base + half : base;
+		nr -= half;
+	}
+
+	return le64_to_cpu(n->keys[base]) <= key ? (int) base : -1;
+}
+
+/*
+ * Returns the index of the first key >= |key|, which may be
+ * nr_entries.
+ */
+static unsigned upper_index(struct node *n, uint64_t key)
+{
+	int i = ext_lower_bound(n, key);
+
+	if (i >= 0 && le64_to_cpu(n->keys[i]) == key)
+		return i;
+
+	return i + 1;
+}
+
+static int is_internal(struct node *n)
+{
+	return le32_to_cpu(n->header.flags) & INTERNAL_NODE;
+}
+
+/*
+ * A shadow of a node that is shared with another tree holds new
+ * references to everything beneath it.
+ */
+static void ext_inc_children(struct dm_btree_info *info, struct node *n)
+{
+	unsigned i;
+	struct dm_btree_value_type *vt = &info->value_type;
+
+	for (i = 0; i < nr_entries(n); i++) {
+		if (is_internal(n))
+			dm_tm_inc(info->tm, ext_value64(n, i));
+		else if (vt->copy)
+			vt->copy(vt->context, ext_value_ptr(n, i, vt->size));
+	}
+}
+
+static int shadow_node(struct dm_btree_info *info, dm_block_t b,
+		       struct dm_block **result, unsigned long *nr_shadows)
+{
+	int r, inc;
+
+	r = dm_tm_shadow_block(info->tm, b, result, &inc);
+	if (r < 0)
+		return r;
+
+	if (nr_shadows)
+		(*nr_shadows)++;
+
+	if (inc)
+		ext_inc_children(info, dm_block_data(*result));
+
+	return 0;
+}
+
+/*
+ * Takes a copy of the header dm_btree_empty() writes for a node holding
+ * values of |value_size|, so the nodes we build ourselves match those
+ * built by the btree code.  The block it allocates is released again.
+ */
+static int get_header(struct dm_btree_info *info, size_t value_size,
+		      struct node_header *header)
+{
+	int r;
+	dm_block_t b;
+	struct dm_block *block;
+	struct dm_btree_info tmp = *info;
+
+	tmp.value_type.size = value_size;
+	r = dm_btree_empty(&tmp, &b);
+	if (r < 0)
+		return r;
+
+	r = dm_tm_read_lock(info->tm, b, &block);
+	if (r == 0) {
+		*header = ((struct node *) dm_block_data(block))->header;
+		dm_tm_unlock(info->tm, block);
+	}
+
+	dm_tm_dec(info->tm, b);
+	return r;
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Bulk loading.  Each level keeps the node currently being filled, and
+ * the full node before it.  A full node isn't passed up to its parent
+ * until the one after it is also full, so that at the end the last two
+ * nodes of each level can be evened out and no node is left nearly
+ * empty.
+ */
+struct load_level {
+	struct dm_block *prev;
+	struct dm_block *cur;
+};
+
+struct loader {
+	struct dm_btree_info *info;
+	struct node_header leaf_header;
+	struct node_header internal_header;
+	unsigned depth;
+	struct load_level levels[DM_BTREE_EXT_MAX_DEPTH];
+};
+
+static int new_node(struct loader *l, unsigned level, struct dm_block **result)
+{
+	int r;
+	struct node *n;
+
+	r = dm_tm_new_block(l->info->tm, result);
+	if (r < 0)
+		return r;
+
+	n = dm_block_data(*result);
+	n->header = level ? l->internal_header : l->leaf_header;
+	n->header.flags = cpu_to_le32(level ? INTERNAL_NODE : LEAF_NODE);
+	n->header.nr_entries = cpu_to_le32(0);
+
+	if (level >= l->depth)
+		l->depth = level + 1;
+
+	return 0;
+}
+
+static int push(struct loader *l, unsigned level, uint64_t key, void *value);
+
+/*
+ * Unlocks a finished node and adds it to the level above.
+ */
+static int pass_up(struct loader *l, unsigned level, struct dm_block *b)
+{
+	struct node *n = dm_block_data(b);
+	uint64_t key = le64_to_cpu(n->keys[0]);
+	__le64 location = cpu_to_le64(dm_block_location(b));
+
+	dm_tm_unlock(l->info->tm, b);
+	return push(l, level + 1, key, &location);
+}
+
+static int push(struct loader *l, unsigned level, uint64_t key, void *value)
+{
+	int r;
+	struct load_level *ll;
+	struct node *n;
+	size_t value_size = level ? sizeof(__le64) : l->info->value_type.size;
+
+	if (level == DM_BTREE_EXT_MAX_DEPTH)
+		return -ENOSPC;
+
+	ll = l->levels + level;
+	if (!ll->cur) {
+		r = new_node(l, level, &ll->cur);
+		if (r < 0)
+			return r;
+
+	} else {
+		n = dm_block_data(ll->cur);
+		if (nr_entries(n) == max_entries(n)) {
+			if (ll->prev) {
+				struct dm_block *full = ll->prev;
+
+				ll->prev = NULL;
+				r = pass_up(l, level, full);
+				if (r < 0)
+					return r;
+			}
+
+			ll->prev = ll->cur;
+			ll->cur = NULL;
+			r = new_node(l, level, &ll->cur);
+			if (r < 0)
+				return r;
+		}
+	}
+
+	n = dm_block_data(ll->cur);
+	n->keys[nr_entries(n)] = cpu_to_le64(key);
+	memcpy(ext_value_ptr(n, nr_entries(n), value_size), value, value_size);
+	n->header.nr_entries = cpu_to_le32(nr_entries(n) + 1);
+
+	return 0;
+}
+
+/*
+ * Moves entries from the end of a full |left| to the front of |right|
+ * until they hold half each.
+ */
+static void even_out(struct node *left, struct node *right, size_t value_size)
+{
+	unsigned nr_left = nr_entries(left);
+	unsigned nr_right = nr_entries(right);
+	unsigned target = (nr_left + nr_right) / 2;
+	unsigned count;
+
+	if (nr_right >= target)
+		return;
+
+	count = target - nr_right;
+	memmove(right->keys + count, right->keys, nr_right * sizeof(__le64));
+	memmove(ext_value_ptr(right, count, value_size),
+		ext_value_ptr(right, 0, value_size),
+		nr_right * value_size);
+
+	memcpy(right->keys, left->keys + nr_left - count, count * sizeof(__le64));
+	memcpy(ext_value_ptr(right, 0, value_size),
+	       ext_value_ptr(left, nr_left - count, value_size),
+	       count * value_size);
+
+	left->header.nr_entries = cpu_to_le32(nr_left - count);
+	right->header.nr_entries = cpu_to_le32(nr_right + count);
+}
+
+static int finish(struct loader *l, dm_block_t *root)
+{
+	int r;
+	unsigned level;
+	struct load_level *ll;
+
+	for (level = 0; level < l->depth; level++) {
+		ll = l->levels + level;
+
+		if (!ll->prev) {
+			/* the only node at the top level is the root */
+			*root = dm_block_location(ll->cur);
+			dm_tm_unlock(l->info->tm, ll->cur);
+			ll->cur = NULL;
+			return 0;
+		}
+
+		even_out(dm_block_data(ll->prev), dm_block_data(ll->cur),
+			 level ? sizeof(__le64) : l->info->value_type.size);
+
+		r = pass_up(l, level, ll->prev);
+		ll->prev = NULL;
+		if (r < 0)
+			return r;
+
+		r = pass_up(l, level, ll->cur);
+		ll->cur = NULL;
+		if (r < 0)
+			return r;
+	}
+
+	return -EINVAL;
+}
+
+static void unlock_all(struct loader *l)
+{
+	unsigned level;
+
+	for (level = 0; level < l->depth; level++) {
+		if (l->levels[level].prev)
+			dm_tm_unlock(l->info->tm, l->levels[level].prev);
+
+		if (l->levels[level].cur)
+			dm_tm_unlock(l->info->tm, l->levels[level].cur);
+	}
+}
+
+int dm_btree_bulk_load(struct dm_btree_info *info,
+		       dm_btree_next_fn next, void *context,
+		       dm_block_t *root)
+{
+	int r;
+	uint64_t key, last_key = 0;
+	unsigned count = 0;
+	void *value;
+	struct loader *l;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!l)
+		return -ENOMEM;
+
+	value = kmalloc(info->value_type.size, GFP_KERNEL);
+	if (!value) {
+		kfree(l);
+		return -ENOMEM;
+	}
+
+	l->info = info;
+	r = get_header(info, info->value_type.size, &l->leaf_header);
+	if (r < 0)
+		goto out;
+
+	r = get_header(info, sizeof(__le64), &l->internal_header);
+	if (r < 0)
+		goto out;
+
+	for (;;) {
+		r = next(context, &key, value);
+		if (r == -ENODATA)
+			break;
+
+		if (r < 0)
+			goto out;
+
+		if (count++ && key <= last_key) {
+			r = -EINVAL;
+			goto out;
+		}
+		last_key = key;
+
+		r = push(l, 0, key, value);
+		if (r < 0)
+			goto out;
+	}
+
+	if (count)
+		r = finish(l, root);
+	else
+		r = dm_btree_empty(info, root);
+
+out:
+	unlock_all(l);
+	kfree(value);
+	kfree(l);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_bulk_load);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Cursors.
+ */
+
+/*
+ * Walks down from |b| to a leaf, extending the path.  If |leftmost| the
+ * first entry of each node is taken, otherwise the entries leading to
+ * |key|.
+ */
+static int cursor_descend(struct dm_btree_cursor *c, dm_block_t b,
+			  uint64_t key, int leftmost)
+{
+	int r, i;
+	struct dm_block *block;
+	struct node *n;
+
+	for (;;) {
+		if (c->depth == DM_BTREE_EXT_MAX_DEPTH)
+			return -EINVAL;
+
+		r = dm_tm_read_lock(c->info->tm, b, &block);
+		if (r < 0)
+			return r;
+
+		n = dm_block_data(block);
+		c->path[c->depth].b = b;
+
+		if (!is_internal(n)) {
+			c->path[c->depth++].index = leftmost ? 0 : upper_index(n, key);
+			c->leaf = block;
+			return 0;
+		}
+
+		i = leftmost ? 0 : ext_lower_bound(n, key);
+		if (i < 0)
+			i = 0;
+
+		c->path[c->depth++].index = i;
+		b = ext_value64(n, i);
+		dm_tm_unlock(c->info->tm, block);
+	}
+}
+
+/*
+ * Moves on to the first entry of the next leaf that has one.
+ */
+static int cursor_next_leaf(struct dm_btree_cursor *c)
+{
+	int r;
+	dm_block_t child;
+	struct dm_block *block;
+	struct node *n;
+
+	do {
+		dm_tm_unlock(c->info->tm, c->leaf);
+		c->leaf = NULL;
+		c->depth--;
+
+		for (;;) {
+			if (!c->depth)
+				return -ENODATA;
+
+			r = dm_tm_read_lock(c->info->tm, c->path[c->depth - 1].b, &block);
+			if (r < 0)
+				return r;
+
+			n = dm_block_data(block);
+			if (c->path[c->depth - 1].index + 1 < nr_entries(n))
+				break;
+
+			dm_tm_unlock(c->info->tm, block);
+			c->depth--;
+		}
+
+		child = ext_value64(n, ++c->path[c->depth - 1].index);
+		dm_tm_unlock(c->info->tm, block);
+
+		r = cursor_descend(c, child, 0, 1);
+		if (r < 0)
+			return r;
+
+	} while (!nr_entries(dm_block_data(c->leaf)));
+
+	return 0;
+}
+
+int dm_btree_cursor_begin(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t key, struct dm_btree_cursor *c)
+{
+	int r;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	c->info = info;
+	c->depth = 0;
+	c->leaf = NULL;
+
+	r = cursor_descend(c, root, key, 0);
+	if (r == 0 &&
+	    c->path[c->depth - 1].index >= nr_entries(dm_block_data(c->leaf)))
+		r = cursor_next_leaf(c);
+
+	if (r < 0)
+		dm_btree_cursor_end(c);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_cursor_begin);
+
+void dm_btree_cursor_end(struct dm_btree_cursor *c)
+{
+	if (c->leaf) {
+		dm_tm_unlock(c->info->tm, c->leaf);
+		c->leaf = NULL;
+	}
+}
+EXPORT_SYMBOL_GPL(dm_btree_cursor_end);
+
+int dm_btree_cursor_next(struct dm_btree_cursor *c)
+{
+	int r;
+
+	if (!c->leaf)
+		return -ENODATA;
+
+	if (++c->path[c->depth - 1].index < nr_entries(dm_block_data(c->leaf)))
+		return 0;
+
+	r = cursor_next_leaf(c);
+	if (r < 0)
+		dm_btree_cursor_end(c);
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_cursor_next);
+
+int dm_btree_cursor_get(struct dm_btree_cursor *c, uint64_t *key, void *value)
+{
+	unsigned index;
+	struct node *n;
+
+	if (!c->leaf)
+		return -ENODATA;
+
+	n = dm_block_data(c->leaf);
+	index = c->path[c->depth - 1].index;
+	*key = le64_to_cpu(n->keys[index]);
+	memcpy(value, ext_value_ptr(n, index, c->info->value_type.size),
+	       c->info->value_type.size);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_btree_cursor_get);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Batched insert.
+ */
+
+/*
+ * Shadows the path to the leaf that keys[0] belongs in, and inserts
+ * keys[0] and as many of the following keys as also belong in that leaf
+ * and fit.  Returns the number inserted, which is 0 if the leaf was
+ * already full.
+ */
+static int insert_run(struct dm_btree_info *info, dm_block_t root,
+		      uint64_t *keys, uint8_t *values, unsigned count,
+		      dm_block_t *new_root, unsigned long *nr_shadows)
+{
+	int r, i;
+	unsigned done = 0, index;
+	uint64_t limit = 0;
+	int has_limit = 0;
+	size_t value_size = info->value_type.size;
+	struct dm_btree_value_type *vt = &info->value_type;
+	struct dm_block *block, *child;
+	struct node *n;
+
+	r = shadow_node(info, root, &block, nr_shadows);
+	if (r < 0)
+		return r;
+
+	*new_root = dm_block_location(block);
+
+	for (;;) {
+		n = dm_block_data(block);
+		if (!is_internal(n))
+			break;
+
+		i = ext_lower_bound(n, keys[0]);
+		if (i < 0) {
+			/* extend the lowest key to cover this one */
+			n->keys[0] = cpu_to_le64(keys[0]);
+			i = 0;
+		}
+
+		if (i + 1 < nr_entries(n)) {
+			limit = le64_to_cpu(n->keys[i + 1]);
+			has_limit = 1;
+		}
+
+		r = shadow_node(info, ext_value64(n, i), &child, nr_shadows);
+		if (r < 0) {
+			dm_tm_unlock(info->tm, block);
+			return r;
+		}
+
+		*((__le64 *) ext_value_ptr(n, i, sizeof(__le64))) =
+			cpu_to_le64(dm_block_location(child));
+		dm_tm_unlock(info->tm, block);
+		block = child;
+	}
+
+	while (done < count && (!has_limit || keys[done] < limit)) {
+		void *value = values + done * value_size;
+
+		index = upper_index(n, keys[done]);
+		if (index < nr_entries(n) && le64_to_cpu(n->keys[index]) == keys[done]) {
+			void *old = ext_value_ptr(n, index, value_size);
+
+			if (vt->del && (!vt->equal || !vt->equal(vt->context, old, value)))
+				vt->del(vt->context, old);
+
+			memcpy(old, value, value_size);
+
+		} else {
+			if (nr_entries(n) == max_entries(n))
+				break;
+
+			memmove(n->keys + index + 1, n->keys + index,
+				(nr_entries(n) - index) * sizeof(__le64));
+			memmove(ext_value_ptr(n, index + 1, value_size),
+				ext_value_ptr(n, index, value_size),
+				(nr_entries(n) - index) * value_size);
+
+			n->keys[index] = cpu_to_le64(keys[done]);
+			memcpy(ext_value_ptr(n, index, value_size), value, value_size);
+			n->header.nr_entries = cpu_to_le32(nr_entries(n) + 1);
+		}
+
+		done++;
+	}
+
+	dm_tm_unlock(info->tm, block);
+	return done;
+}
+
+int dm_btree_insert_sorted(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t *keys, void *values, unsigned count,
+			   dm_block_t *new_root,
+			   struct dm_btree_insert_stats *stats)
+{
+	int r;
+	unsigned i, done = 0;
+	uint8_t *v = values;
+	size_t value_size = info->value_type.size;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	for (i = 1; i < count; i++)
+		if (keys[i] <= keys[i - 1])
+			return -EINVAL;
+
+	while (done < count) {
+		r = insert_run(info, root, keys + done, v + done * value_size,
+			       count - done, &root,
+			       stats ? &stats->shadows : NULL);
+		if (r < 0)
+			return r;
+
+		if (stats)
+			stats->descents++;
+
+		if (!r) {
+			r = dm_btree_insert(info, root, keys + done,
+					    v + done * value_size, &root);
+			if (r < 0)
+				return r;
+
+			if (stats) {
+				stats->descents++;
+				stats->full_leaves++;
+			}
+
+			r = 1;
+		}
+
+		done += r;
+	}
+
+	*new_root = root;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_btree_insert_sorted);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Lookups through a context.
+ */
+void dm_btree_lookup_ctx_init(struct dm_btree_lookup_ctx *ctx)
+{
+	ctx->root = 0;
+	ctx->depth = 0;
+	ctx->lookups = 0;
+	ctx->node_reads = 0;
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_ctx_init);
+
+static int in_range(struct dm_btree_lookup_ctx *ctx, unsigned level, uint64_t key)
+{
+	return (!ctx->path[level].has_lo || key >= ctx->path[level].lo) &&
+		(!ctx->path[level].has_hi || key < ctx->path[level].hi);
+}
+
+/*
+ * A remembered node that no longer holds keys in its range has been
+ * changed or reused.
+ */
+static int still_fits(struct dm_btree_lookup_ctx *ctx, unsigned level, struct node *n)
+{
+	unsigned nr = nr_entries(n);
+
+	return !nr ||
+		(in_range(ctx, level, le64_to_cpu(n->keys[0])) &&
+		 in_range(ctx, level, le64_to_cpu(n->keys[nr - 1])));
+}
+
+static void ctx_set_root(struct dm_btree_lookup_ctx *ctx, dm_block_t root)
+{
+	ctx->root = root;
+	ctx->depth = 1;
+	ctx->path[0].b = root;
+	ctx->path[0].has_lo = 0;
+	ctx->path[0].has_hi = 0;
+}
+
+int dm_btree_lookup_cached(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t key, void *value,
+			   struct dm_btree_lookup_ctx *ctx)
+{
+	int r, i, check = 0;
+	unsigned level = 0;
+	dm_block_t b = root;
+	struct dm_block *block;
+	struct node *n;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	if (ctx) {
+		ctx->lookups++;
+		if (!ctx->depth || ctx->root != root)
+			ctx_set_root(ctx, root);
+
+		level = ctx->depth - 1;
+		while (level && !in_range(ctx, level, key))
+			level--;
+		b = ctx->path[level].b;
+		check = level > 0;
+	}
+
+	for (;;) {
+		r = dm_tm_read_lock(info->tm, b, &block);
+		if (r < 0)
+			return r;
+
+		n = dm_block_data(block);
+		if (ctx) {
+			ctx->node_reads++;
+			if (check && !still_fits(ctx, level, n)) {
+				dm_tm_unlock(info->tm, block);
+				ctx_set_root(ctx, root);
+				level = 0;
+				b = root;
+				check = 0;
+				continue;
+			}
+			check = 0;
+			ctx->depth = level + 1;
+		}
+
+		i = ext_lower_bound(n, key);
+		if (!is_internal(n))
+			break;
+
+		if (i < 0 || level + 1 == DM_BTREE_EXT_MAX_DEPTH) {
+			dm_tm_unlock(info->tm, block);
+			return i < 0 ? -ENODATA : -EINVAL;
+		}
+
+		b = ext_value64(n, i);
+		if (ctx) {
+			ctx->path[level + 1].b = b;
+			ctx->path[level + 1].has_lo = 1;
+			ctx->path[level + 1].lo = le64_to_cpu(n->keys[i]);
+			if (i + 1 < nr_entries(n)) {
+				ctx->path[level + 1].has_hi = 1;
+				ctx->path[level + 1].hi = le64_to_cpu(n->keys[i + 1]);
+			} else {
+				ctx->path[level + 1].has_hi = ctx->path[level].has_hi;
+				ctx->path[level + 1].hi = ctx->path[level].hi;
+			}
+		}
+
+		dm_tm_unlock(info->tm, block);
+		level++;
+	}
+
+	if (i < 0 || le64_to_cpu(n->keys[i]) != key)
+		r = -ENODATA;
+	else
+		memcpy(value, ext_value_ptr(n, i, info->value_type.size),
+		       info->value_type.size);
+
+	dm_tm_unlock(info->tm, block);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_cached);
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Range removal.
+ */
+static void remove_entries(struct node *n, unsigned index, unsigned count,
+			   size_t value_size)
+{
+	unsigned nr = nr_entries(n);
+
+	memmove(n->keys + index, n->keys + index + count,
+		(nr - index - count) * sizeof(__le64));
+	memmove(ext_value_ptr(n, index, value_size),
+		ext_value_ptr(n, index + count, value_size),
+		(nr - index - count) * value_size);
+	n->header.nr_entries = cpu_to_le32(nr - count);
+}
+
+/*
+ * If children |index| and |index| + 1 of |n| fit in one node, moves the
+ * second's entries into the first, releases the second and returns 1.
+ */
+static int merge_children(struct dm_btree_info *info, struct node *n,
+			  unsigned index)
+{
+	int r;
+	unsigned nr_left, nr_right, max;
+	size_t value_size;
+	struct dm_block *left, *right;
+	struct node *ln, *rn;
+
+	r = dm_tm_read_lock(info->tm, ext_value64(n, index), &left);
+	if (r < 0)
+		return r;
+
+	ln = dm_block_data(left);
+	nr_left = nr_entries(ln);
+	max = max_entries(ln);
+	dm_tm_unlock(info->tm, left);
+
+	r = dm_tm_read_lock(info->tm, ext_value64(n, index + 1), &right);
+	if (r < 0)
+		return r;
+
+	rn = dm_block_data(right);
+	nr_right = nr_entries(rn);
+	dm_tm_unlock(info->tm, right);
+
+	if (nr_left + nr_right > max)
+		return 0;
+
+	r = shadow_node(info, ext_value64(n, index), &left, NULL);
+	if (r < 0)
+		return r;
+
+	r = shadow_node(info, ext_value64(n, index + 1), &right, NULL);
+	if (r < 0) {
+		dm_tm_unlock(info->tm, left);
+		return r;
+	}
+
+	ln = dm_block_data(left);
+	rn = dm_block_data(right);
+	value_size = is_internal(ln) ? sizeof(__le64) : info->value_type.size;
+
+	memcpy(ln->keys + nr_left, rn->keys, nr_right * sizeof(__le64));
+	memcpy(ext_value_ptr(ln, nr_left, value_size), ext_value_ptr(rn, 0, value_size),
+	       nr_right * value_size);
+	ln->header.nr_entries = cpu_to_le32(nr_left + nr_right);
+
+	*((__le64 *) ext_value_ptr(n, index, sizeof(__le64))) =
+		cpu_to_le64(dm_block_location(left));
+
+	/* everything beneath the right node now belongs to the left */
+	dm_tm_unlock(info->tm, left);
+	dm_tm_unlock(info->tm, right);
+	dm_tm_dec(info->tm, dm_block_location(right));
+
+	remove_entries(n, index + 1, 1, sizeof(__le64));
+	return 1;
+}
+
+/*
+ * Removes the range from the subtree at |b|, whose keys are all below
+ * |hi| if |has_hi|.  The node may be left empty, in which case the
+ * caller drops it.
+ */
+static int remove_range_node(struct dm_btree_info *info, dm_block_t b,
+			     uint64_t begin, uint64_t end,
+			     int has_hi, uint64_t hi,
+			     dm_block_t *new_b, unsigned depth)
+{
+	int r, first;
+	unsigned nr, last, kept, j, child_nr;
+	uint64_t lo_i, hi_i;
+	int has_hi_i;
+	dm_block_t child, new_child;
+	struct dm_block *block, *child_block;
+	struct node *n;
+	struct dm_btree_value_type *vt = &info->value_type;
+
+	if (depth == DM_BTREE_EXT_MAX_DEPTH)
+		return -EINVAL;
+
+	r = shadow_node(info, b, &block, NULL);
+	if (r < 0)
+		return r;
+
+	n = dm_block_data(block);
+	*new_b = dm_block_location(block);
+
+	if (!is_internal(n)) {
+		first = upper_index(n, begin);
+		last = upper_index(n, end);
+
+		if (vt->del)
+			for (j = first; j < last; j++)
+				vt->del(vt->context, ext_value_ptr(n, j, vt->size));
+
+		remove_entries(n, first, last - first, vt->size);
+		dm_tm_unlock(info->tm, block);
+		return 0;
+	}
+
+	first = ext_lower_bound(n, begin);
+	if (first < 0)
+		first = 0;
+
+	/* visit the children whose ranges overlap [begin, end) */
+	nr = nr_entries(n);
+	kept = first;
+	for (j = first; j < nr; j++) {
+		lo_i = le64_to_cpu(n->keys[j]);
+		if (lo_i >= end)
+			break;
+
+		has_hi_i = j + 1 < nr ? 1 : has_hi;
+		hi_i = j + 1 < nr ? le64_to_cpu(n->keys[j + 1]) : hi;
+		child = ext_value64(n, j);
+
+		if (lo_i >= begin && has_hi_i && hi_i <= end) {
+			r = dm_btree_del(info, child);
+			if (r < 0)
+				goto bad;
+			continue;
+		}
+
+		r = remove_range_node(info, child, begin, end, has_hi_i, hi_i,
+				      &new_child, depth + 1);
+		if (r < 0)
+			goto bad;
+
+		r = dm_tm_read_lock(info->tm, new_child, &child_block);
+		if (r < 0)
+			goto bad;
+		child_nr = nr_entries(dm_block_data(child_block));
+		dm_tm_unlock(info->tm, child_block);
+
+		if (!child_nr) {
+			dm_tm_dec(info->tm, new_child);
+			continue;
+		}
+
+		n->keys[kept] = cpu_to_le64(lo_i);
+		*((__le64 *) ext_value_ptr(n, kept, sizeof(__le64))) = cpu_to_le64(new_child);
+		kept++;
+	}
+
+	/* close the gap left by the removed children */
+	memmove(n->keys + kept, n->keys + j, (nr - j) * sizeof(__le64));
+	memmove(ext_value_ptr(n, kept, sizeof(__le64)),
+		ext_value_ptr(n, j, sizeof(__le64)),
+		(nr - j) * sizeof(__le64));
+	n->header.nr_entries = cpu_to_le32(kept + nr - j);
+
+	/*
+	 * The rebalance pass: the children either side of the removed run
+	 * are the only ones that can have shrunk.
+	 */
+	j = first ? first - 1 : 0;
+	while (j + 1 < nr_entries(n) && j <= (unsigned) first + 1) {
+		r = merge_children(info, n, j);
+		if (r < 0)
+			goto bad;
+
+		if (!r)
+			j++;
+	}
+
+	dm_tm_unlock(info->tm, block);
+	return 0;
+
+bad:
+	dm_tm_unlock(info->tm, block);
+	return r;
+}
+
+int dm_btree_remove_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t begin, uint64_t end,
+			  dm_block_t *new_root)
+{
+	int r;
+	unsigned nr;
+	dm_block_t child;
+	struct dm_block *block;
+	struct node *n;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	if (begin >= end) {
+		*new_root = root;
+		return 0;
+	}
+
+	r = remove_range_node(info, root, begin, end, 0, 0, &root, 0);
+	if (r < 0)
+		return r;
+
+	/* shrink the tree while the root has a single child */
+	for (;;) {
+		r = dm_tm_read_lock(info->tm, root, &block);
+		if (r < 0)
+			return r;
+
+		n = dm_block_data(block);
+		nr = nr_entries(n);
+		if (!is_internal(n) || nr > 1) {
+			dm_tm_unlock(info->tm, block);
+			break;
+		}
+
+		child = nr ? ext_value64(n, 0) : 0;
+		dm_tm_unlock(info->tm, block);
+		dm_tm_dec(info->tm, root);
+
+		if (!nr)
+			return dm_btree_empty(info, new_root);
+
+		root = child;
+	}
+
+	*new_root = root;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_btree_remove_range);
+
+/*
+ * Nearest key lookups.  Every key in the children after the one a key
+ * is sent down is above it, and every key in the children before is
+ * below it, so searching those for the same key finds their first or
+ * last entry.
+ */
+static int lookup_nearest(struct dm_btree_info *info, dm_block_t b,
+			  uint64_t *key, void *value, int next,
+			  unsigned depth)
+{
+	int r, i, nr;
+	struct dm_block *block;
+	struct node *n;
+
+	if (depth == DM_BTREE_EXT_MAX_DEPTH)
+		return -EINVAL;
+
+	r = dm_tm_read_lock(info->tm, b, &block);
+	if (r < 0)
+		return r;
+
+	n = dm_block_data(block);
+	nr = nr_entries(n);
+
+	if (is_internal(n)) {
+		i = ext_lower_bound(n, *key);
+		if (i < 0 && next)
+			i = 0;
+
+		r = -ENODATA;
+		for (; i >= 0 && i < nr; i += next ? 1 : -1) {
+			r = lookup_nearest(info, ext_value64(n, i), key, value, next, depth + 1);
+			if (r != -ENODATA)
+				break;
+		}
+
+	} else {
+		i = next ? upper_index(n, *key) : ext_lower_bound(n, *key);
+		if (i < 0 || i >= nr)
+			r = -ENODATA;
+
+		else {
+			*key = le64_to_cpu(n->keys[i]);
+			memcpy(value, ext_value_ptr(n, i, info->value_type.size),
+			       info->value_type.size);
+		}
+	}
+
+	dm_tm_unlock(info->tm, block);
+	return r;
+}
+
+int dm_btree_lookup_next(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *key, void *value)
+{
+	if (info->levels != 1)
+		return -EINVAL;
+
+	return lookup_nearest(info, root, key, value, 1, 0);
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_next);
+
+int dm_btree_lookup_prev(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *key, void *value)
+{
+	if (info->levels != 1)
+		return -EINVAL;
+
+	return lookup_nearest(info, root, key, value, 0, 0);
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_prev);
+
+/*
+ * Statistics.
+ */
+static int walk_node(struct dm_btree_info *info, dm_block_t b,
+		     unsigned level, unsigned depth, int is_root,
+		     struct dm_btree_stats *stats)
+{
+	int r = 0;
+	unsigned i, nr, max, fill;
+	struct dm_block *block;
+	struct node *n;
+
+	if (depth > DM_BTREE_EXT_MAX_DEPTH * info->levels)
+		return -EINVAL;
+
+	r = dm_tm_read_lock(info->tm, b, &block);
+	if (r < 0)
+		return r;
+
+	n = dm_block_data(block);
+	nr = nr_entries(n);
+	max = max_entries(n);
+
+	stats->nr_entries += nr;
+	stats->nr_slots += max;
+	if (!is_root) {
+		fill = max ? nr * 100 / max : 0;
+		if (fill < stats->min_fill)
+			stats->min_fill = fill;
+	}
+
+	if (is_internal(n)) {
+		stats->nr_internal++;
+		for (i = 0; i < nr && !r; i++)
+			r = walk_node(info, ext_value64(n, i), level, depth + 1, 0, stats);
+
+	} else {
+		stats->nr_leaves++;
+		if (level + 1 < info->levels) {
+			/* the values are the roots of the next level's trees */
+			for (i = 0; i < nr && !r; i++)
+				r = walk_node(info, ext_value64(n, i), level + 1, depth + 1, 1, stats);
+
+		} else {
+			stats->nr_mappings += nr;
+			if (depth > stats->depth)
+				stats->depth = depth;
+		}
+	}
+
+	dm_tm_unlock(info->tm, block);
+	return r;
+}
+
+int dm_btree_walk_stats(struct dm_btree_info *info, dm_block_t root,
+			struct dm_btree_stats *stats)
+{
+	int r;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->min_fill = 100;
+
+	r = walk_node(info, root, 0, 1, 1, stats);
+	if (r < 0)
+		return r;
+
+	stats->metadata_bytes = (uint64_t) (stats->nr_internal + stats->nr_leaves) *
+		dm_bm_block_size(dm_tm_get_bm(info->tm));
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_btree_walk_stats);
+
+int dm_btree_node_search(struct node *n, uint64_t key)
+{
+	return ext_lower_bound(n, key);
+}
+EXPORT_SYMBOL_GPL(dm_btree_node_search);
+
+int dm_btree_node_search_binary(struct node *n, uint64_t key)
+{
+	return ext_lower_bound_binary(n, key);
+}
+EXPORT_SYMBOL_GPL(dm_btree_node_search_binary);
+
+int dm_btree_lookup_search(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t key, void *value, dm_btree_search_fn search)
+{
+	int r, i;
+	unsigned depth = 0;
+	dm_block_t b = root;
+	struct dm_block *block;
+	struct node *n;
+
+	if (info->levels != 1)
+		return -EINVAL;
+
+	for (;;) {
+		r = dm_tm_read_lock(info->tm, b, &block);
+		if (r < 0)
+			return r;
+
+		n = dm_block_data(block);
+		i = search(n, key);
+		if (!is_internal(n))
+			break;
+
+		if (i < 0 || ++depth == DM_BTREE_EXT_MAX_DEPTH) {
+			dm_tm_unlock(info->tm, block);
+			return i < 0 ? -ENODATA : -EINVAL;
+		}
+
+		b = ext_value64(n, i);
+		dm_tm_unlock(info->tm, block);
+	}
+
+	if (i < 0 || le64_to_cpu(n->keys[i]) != key)
+		r = -ENODATA;
+	else
+		memcpy(value, ext_value_ptr(n, i, info->value_type.size),
+		       info->value_type.size);
+
+	dm_tm_unlock(info->tm, block);
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_search);
+
+/*----------------------------------------------------------------*/
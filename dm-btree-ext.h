@@ -0,0 +1,200 @@
+#ifndef SNAPSHOTS_BTREE_EXT_H
+#define SNAPSHOTS_BTREE_EXT_H
+
+#include "md/persistent-data/dm-btree.h"
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Extra btree operations that work directly on the node format in
+ * dm-btree-internal.h.  Trees built or changed by these can be used
+ * with the normal btree functions, and vice versa.  Apart from the
+ * statistics walker, only single level trees are handled, ie.
+ * info->levels must be 1.  This is only used by test code.
+ */
+
+/*
+ * No tree we can address gets deeper than this.
+ */
+#define DM_BTREE_EXT_MAX_DEPTH 16
+
+/*
+ * Supplies the next key/value pair to dm_btree_bulk_load().  Returns 0
+ * with |key| and |value| filled in, or -ENODATA once there are no more.
+ */
+typedef int (*dm_btree_next_fn)(void *context, uint64_t *key, void *value);
+
+/*
+ * Builds a new tree from pairs given in strictly ascending key order.
+ * Nodes are filled completely and written bottom up, so each block is
+ * allocated and written exactly once, rather than the path shadowing
+ * and splitting that the same number of dm_btree_insert() calls would
+ * do.  Must be called within a transaction.
+ */
+int dm_btree_bulk_load(struct dm_btree_info *info,
+		       dm_btree_next_fn next, void *context,
+		       dm_block_t *root);
+
+/*
+ * A cursor steps through a tree in key order.  Only the current leaf is
+ * kept locked; the nodes above it are remembered by block number and
+ * relocked when the cursor moves on to the next leaf.  The tree must
+ * not change, and nothing else may lock the current leaf, while the
+ * cursor is open.
+ */
+struct dm_btree_cursor {
+	struct dm_btree_info *info;
+
+	unsigned depth;
+	struct {
+		dm_block_t b;
+		unsigned index;
+	} path[DM_BTREE_EXT_MAX_DEPTH];
+
+	struct dm_block *leaf;	/* path[depth - 1], or NULL once past the end */
+};
+
+/*
+ * Positions the cursor at the first key >= |key|.  Returns -ENODATA if
+ * there is no such key, in which case the cursor needn't be ended.
+ */
+int dm_btree_cursor_begin(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t key, struct dm_btree_cursor *c);
+void dm_btree_cursor_end(struct dm_btree_cursor *c);
+
+/*
+ * Moves to the next key.  Returns -ENODATA, and releases the cursor,
+ * when there are no more.
+ */
+int dm_btree_cursor_next(struct dm_btree_cursor *c);
+int dm_btree_cursor_get(struct dm_btree_cursor *c, uint64_t *key, void *value);
+
+/*
+ * Counters for dm_btree_insert_sorted().  |descents| is the number of
+ * root to leaf walks made, and |shadows| the number of nodes shadowed
+ * on those walks.  |full_leaves| counts keys that found their leaf full
+ * and were handed to dm_btree_insert() to split it.
+ */
+struct dm_btree_insert_stats {
+	unsigned long descents;
+	unsigned long shadows;
+	unsigned long full_leaves;
+};
+
+/*
+ * Inserts |count| pairs, given in strictly ascending key order, with
+ * |values| holding count values of value_type.size bytes.  All the keys
+ * that belong in the same leaf are inserted under a single shadowing of
+ * the path to it, and a single lock of the leaf.  Existing keys have
+ * their values replaced, as dm_btree_insert() does.  |stats| may be
+ * NULL, otherwise it is added to.
+ */
+int dm_btree_insert_sorted(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t *keys, void *values, unsigned count,
+			   dm_block_t *new_root,
+			   struct dm_btree_insert_stats *stats);
+
+/*
+ * A lookup context remembers the path taken by the last lookup made
+ * through it, and the range of keys beneath each node on that path.  A
+ * lookup for a key in the same leaf's range goes straight to the leaf;
+ * otherwise it restarts from the lowest remembered node whose range
+ * covers the key.  A remembered node is checked against its range
+ * before it's used, and the whole path is dropped if the root changes.
+ * Neither catches every change made to a tree within a transaction, so
+ * reinitialise the context after changing the tree.
+ */
+struct dm_btree_lookup_ctx {
+	dm_block_t root;
+
+	unsigned depth;		/* nodes remembered, 0 for none */
+	struct {
+		dm_block_t b;
+		int has_lo, has_hi;
+		uint64_t lo, hi;	/* keys beneath are in [lo, hi) */
+	} path[DM_BTREE_EXT_MAX_DEPTH];
+
+	unsigned long lookups;
+	unsigned long node_reads;
+};
+
+void dm_btree_lookup_ctx_init(struct dm_btree_lookup_ctx *ctx);
+
+/*
+ * Like dm_btree_lookup(), for single level trees.  |ctx| may be NULL.
+ */
+int dm_btree_lookup_cached(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t key, void *value,
+			   struct dm_btree_lookup_ctx *ctx);
+
+/*
+ * Removes every key in [|begin|, |end|), calling value_type.del on each
+ * value removed.  Subtrees that lie wholly inside the range are dropped
+ * with dm_btree_del(), and only the paths to the two ends of the range
+ * are shadowed.  Nodes left small along those paths are merged with a
+ * neighbour where the two fit in one node, and the root is replaced by
+ * its only child for as long as it has just one.
+ */
+int dm_btree_remove_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t begin, uint64_t end,
+			  dm_block_t *new_root);
+
+/*
+ * Find the entry with the lowest key >= *|key| (next), or the highest
+ * key <= *|key| (prev), and set *|key| to it.  This takes one descent,
+ * stepping into a neighbouring subtree only when the key lies past the
+ * end of the one it was sent down.  Returns -ENODATA if there's no such
+ * entry.
+ */
+int dm_btree_lookup_next(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *key, void *value);
+int dm_btree_lookup_prev(struct dm_btree_info *info, dm_block_t root,
+			 uint64_t *key, void *value);
+
+/*
+ * Shape of a tree, from dm_btree_walk_stats().  Multi level trees are
+ * followed down through every level; |depth| is the number of nodes on
+ * the longest path from the top root to a bottom level leaf, and
+ * |nr_mappings| the number of entries in bottom level leaves.  The
+ * fill factor of a node is nr_entries / max_entries; |min_fill| leaves
+ * out the root of each level, which is allowed to be nearly empty.
+ * Nodes shared with other trees are counted here anyway.
+ */
+struct dm_btree_stats {
+	unsigned depth;
+	unsigned long nr_internal;
+	unsigned long nr_leaves;
+	unsigned long nr_mappings;
+	unsigned long nr_entries;	/* over all nodes */
+	unsigned long nr_slots;		/* max_entries over all nodes */
+	unsigned min_fill;		/* percent */
+	uint64_t metadata_bytes;
+};
+
+int dm_btree_walk_stats(struct dm_btree_info *info, dm_block_t root,
+			struct dm_btree_stats *stats);
+
+/*
+ * The in-node searches, exposed for benchmarking.  Both return the index
+ * of the last key <= |key| in the node, or -1 if there isn't one.  The
+ * functions above all use dm_btree_node_search(), which doesn't branch
+ * on key comparisons; dm_btree_node_search_binary() is the classic
+ * binary search.
+ */
+struct node;
+int dm_btree_node_search(struct node *n, uint64_t key);
+int dm_btree_node_search_binary(struct node *n, uint64_t key);
+
+/*
+ * Like dm_btree_lookup_cached() with no context, but searching each node
+ * with |search|, one of the two above.  This lets whole lookups be timed
+ * with either search.
+ */
+typedef int (*dm_btree_search_fn)(struct node *n, uint64_t key);
+
+int dm_btree_lookup_search(struct dm_btree_info *info, dm_block_t root,
+			   uint64_t key, void *value, dm_btree_search_fn search);
+
+/*----------------------------------------------------------------*/
+
+#endif
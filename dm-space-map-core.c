@@ -1,21 +1,94 @@
 #include "dm-space-map-core.h"
 
+#include <linux/bitops.h>
+
 /*----------------------------------------------------------------*/
 
+struct undo_entry {
+	dm_block_t b;
+	uint32_t old_count;
+};
+
 /* FIXME: some locking might be a good idea */
 struct sm_core {
 	dm_block_t nr;
 	dm_block_t nr_free;
 	dm_block_t maybe_first_free;
+
+	/* undo log, only kept once a checkpoint has been taken */
+	int checkpointed;
+	dm_block_t checkpoint_nr_free;
+	dm_block_t checkpoint_maybe_first_free;
+	unsigned nr_undo;
+	unsigned max_undo;
+	struct undo_entry *undo;
+
+	/* blocks whose count has fallen to zero since the checkpoint */
+	unsigned long *freed;
+
 	uint32_t counts[0];
 };
 
 static void sm_core_destroy(struct dm_space_map *sm)
 {
-	kfree(sm->context);
+	struct sm_core *smc = (struct sm_core *) sm->context;
+
+	kfree(smc->undo);
+	kfree(smc->freed);
+	kfree(smc);
 	kfree(sm);
 }
 
+/*
+ * Must be called before counts[b] is changed.
+ */
+static int log_change(struct sm_core *sm, dm_block_t b)
+{
+	struct undo_entry *undo;
+
+	if (!sm->checkpointed)
+		return 0;
+
+	if (sm->nr_undo == sm->max_undo) {
+		unsigned max = sm->max_undo ? sm->max_undo * 2 : 64;
+
+		undo = krealloc(sm->undo, sizeof(*undo) * max, GFP_KERNEL);
+		if (!undo)
+			return -ENOMEM;
+
+		sm->undo = undo;
+		sm->max_undo = max;
+	}
+
+	sm->undo[sm->nr_undo].b = b;
+	sm->undo[sm->nr_undo].old_count = sm->counts[b];
+	sm->nr_undo++;
+	return 0;
+}
+
+/*
+ * A block freed since the checkpoint may still be referenced by whatever
+ * a rollback returns to, so it isn't handed out again until the next
+ * checkpoint.
+ */
+static int can_allocate(struct sm_core *sm, dm_block_t b)
+{
+	if (sm->counts[b])
+		return 0;
+
+	return !sm->checkpointed || !test_bit(b, sm->freed);
+}
+
+static void block_freed(struct sm_core *sm, dm_block_t b)
+{
+	sm->nr_free++;
+	if (sm->maybe_first_free > b)
+		sm->maybe_first_free = b;
+
+	if (sm->checkpointed)
+		__set_bit(b, sm->freed);
+}
+
 static int sm_core_get_nr_blocks(void *context, dm_block_t *count)
 {
 	struct sm_core *sm = (struct sm_core *) context;
@@ -36,7 +109,7 @@ static int sm_core_get_free(void *context, dm_block_t *b)
 	dm_block_t i;
 
 	for (i = sm->maybe_first_free; i < sm->nr; i++) {
-		if (sm->counts[i] == 0) {
+		if (can_allocate(sm, i)) {
 			*b = i;
 			sm->nr_free--;
 			return 0;
@@ -56,7 +129,7 @@ static int sm_core_get_free_in_range(void *context, dm_block_t low,
 	high = min(high, sm->nr);
 
 	for (i = low; i < high; i++) {
-		if (sm->counts[i] == 0) {
+		if (can_allocate(sm, i)) {
 			*b = i;
 			sm->nr_free--;
 			return 0;
@@ -68,11 +141,16 @@ static int sm_core_get_free_in_range(void *context, dm_block_t low,
 
 static int sm_core_new_block(void *context, dm_block_t *b)
 {
+	int r;
 	struct sm_core *sm = (struct sm_core *) context;
 	dm_block_t i;
 
 	for (i = sm->maybe_first_free; i < sm->nr; i++) {
-		if (sm->counts[i] == 0) {
+		if (can_allocate(sm, i)) {
+			r = log_change(sm, i);
+			if (r)
+				return r;
+
 			sm->counts[i] = 1;
 			*b = i;
 			sm->maybe_first_free = i + 1;
@@ -86,10 +164,15 @@ static int sm_core_new_block(void *context, dm_block_t *b)
 
 static int sm_core_inc_block(void *context, dm_block_t b)
 {
+	int r;
 	struct sm_core *sm = (struct sm_core *) context;
 	if (b >= sm->nr)
 		return -EINVAL;
 
+	r = log_change(sm, b);
+	if (r)
+		return r;
+
 	if (!sm->counts[b]++)
 		sm->nr_free--;
 
@@ -98,18 +181,20 @@ static int sm_core_inc_block(void *context, dm_block_t b)
 
 static int sm_core_dec_block(void *context, dm_block_t b)
 {
+	int r;
 	struct sm_core *sm = (struct sm_core *) context;
 	if (b >= sm->nr)
 		return -EINVAL;
 
 	BUG_ON(sm->counts[b] == 0);
+	r = log_change(sm, b);
+	if (r)
+		return r;
+
 	sm->counts[b]--;
 
-	if (sm->counts[b] == 0) {
-		sm->nr_free++;
-		if (sm->maybe_first_free > b)
-			sm->maybe_first_free = b;
-	}
+	if (sm->counts[b] == 0)
+		block_freed(sm, b);
 
 	return 0;
 }
@@ -127,16 +212,18 @@ static int sm_core_get_count(void *context, dm_block_t b, uint32_t *result)
 
 static int sm_core_set_count(void *context, dm_block_t b, uint32_t count)
 {
+	int r;
 	struct sm_core *sm = (struct sm_core *) context;
 
 	if (b >= sm->nr)
 		return -EINVAL;
 
-	if (count == 0) {
-		sm->nr_free++;
-		if (sm->maybe_first_free > b)
-			sm->maybe_first_free = b;
-	}
+	r = log_change(sm, b);
+	if (r)
+		return r;
+
+	if (count == 0)
+		block_freed(sm, b);
 
 	sm->counts[b] = count;
 	return 0;
@@ -174,6 +261,11 @@ struct dm_space_map *dm_sm_core_create(dm_block_t nr_blocks)
 		smc->nr = nr_blocks;
 		smc->nr_free = nr_blocks;
 		smc->maybe_first_free = 0;
+		smc->checkpointed = 0;
+		smc->nr_undo = 0;
+		smc->max_undo = 0;
+		smc->undo = NULL;
+		smc->freed = NULL;
 		memset(smc->counts, 0, array_size);
 
 		sm = kmalloc(sizeof(*sm), GFP_KERNEL);
@@ -189,4 +281,47 @@ struct dm_space_map *dm_sm_core_create(dm_block_t nr_blocks)
 }
 EXPORT_SYMBOL_GPL(dm_sm_core_create);
 
+int dm_sm_core_checkpoint(struct dm_space_map *sm)
+{
+	unsigned i;
+	struct sm_core *smc = (struct sm_core *) sm->context;
+
+	if (!smc->freed) {
+		smc->freed = kzalloc(sizeof(unsigned long) * BITS_TO_LONGS(smc->nr),
+				     GFP_KERNEL);
+		if (!smc->freed)
+			return -ENOMEM;
+	}
+
+	/* every block freed since the last checkpoint has an undo entry */
+	for (i = 0; i < smc->nr_undo; i++)
+		__clear_bit(smc->undo[i].b, smc->freed);
+
+	smc->checkpointed = 1;
+	smc->checkpoint_nr_free = smc->nr_free;
+	smc->checkpoint_maybe_first_free = smc->maybe_first_free;
+	smc->nr_undo = 0;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_sm_core_checkpoint);
+
+int dm_sm_core_rollback(struct dm_space_map *sm)
+{
+	struct sm_core *smc = (struct sm_core *) sm->context;
+
+	if (!smc->checkpointed)
+		return -EINVAL;
+
+	while (smc->nr_undo) {
+		struct undo_entry *u = smc->undo + --smc->nr_undo;
+		smc->counts[u->b] = u->old_count;
+		__clear_bit(u->b, smc->freed);
+	}
+
+	smc->nr_free = smc->checkpoint_nr_free;
+	smc->maybe_first_free = smc->checkpoint_maybe_first_free;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(dm_sm_core_rollback);
+
 /*----------------------------------------------------------------*/
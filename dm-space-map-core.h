@@ -10,6 +10,21 @@
  */
 struct dm_space_map *dm_sm_core_create(dm_block_t dev_size);
 
+/*
+ * Remembers the current counts, so that every change made since can be
+ * undone by dm_sm_core_rollback().  Rolling back costs time proportional
+ * to the number of changes, not the size of the space map.  Taking a
+ * new checkpoint forgets the previous one.
+ *
+ * Blocks freed after a checkpoint aren't allocated again until the next
+ * one, so a rollback never finds them overwritten.  Until then
+ * get_nr_free may count blocks that can't be allocated yet.  Taking a
+ * checkpoint also costs time proportional to the changes made since the
+ * last one.
+ */
+int dm_sm_core_checkpoint(struct dm_space_map *sm);
+int dm_sm_core_rollback(struct dm_space_map *sm);
+
 /*----------------------------------------------------------------*/
 
 #endif
@@ -1628,6 +1628,105 @@ static int check_devices_persist(void)
 	return destroy_mmd(&tc);
 }
 
+/*
+ * Maps every block of a freshly reopened device with can_block = 0, as
+ * the target's map function would when called on the bio submission
+ * path.  Lookups that would block are deferred, and retried with
+ * can_block = 1 as the worker thread would.  We report how many
+ * completed inline on a cold and then a warm cache.
+ */
+static int nonblocking_map_pass(struct dm_ms_device *msd,
+				struct multisnap_map_result *expected,
+				unsigned *inline_count)
+{
+	int r;
+	dm_block_t b;
+	struct multisnap_map_result result;
+
+	*inline_count = 0;
+	for (b = 0; b < DATA_DEV_SIZE; b++) {
+		r = multisnap_metadata_map(msd, b, READ, 0, &result);
+		if (r == -EWOULDBLOCK)
+			r = multisnap_metadata_map(msd, b, READ, 1, &result);
+		else if (!r)
+			(*inline_count)++;
+
+		if (r) {
+			printk(KERN_ALERT "mmd_map failed for block %u", (unsigned) b);
+			return r;
+		}
+
+		if (result.dest != expected[b].dest) {
+			printk(KERN_ALERT "blocks differ (%u)", (unsigned) b);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_nonblocking_map(void)
+{
+	int r;
+	dm_block_t b;
+	unsigned index, cold, warm;
+	struct test_context tc;
+	static struct multisnap_map_result expected[DATA_DEV_SIZE];
+
+	r = setup_fresh_and_open_thins(&tc, 1);
+	if (r)
+		return r;
+
+	for (b = 0; b < DATA_DEV_SIZE; b++) {
+		r = multisnap_metadata_map(tc.msd[0], b, WRITE, 1, expected + b);
+		if (r) {
+			printk(KERN_ALERT "mmd_map failed");
+			destroy_mmd(&tc);
+			return r;
+		}
+	}
+
+	r = dm_multisnap_metadata_commit(tc.mmd);
+	if (r) {
+		printk(KERN_ALERT "commit failed");
+		destroy_mmd(&tc);
+		return r;
+	}
+
+	/* reopen so we start with nothing in the cache */
+	r = destroy_mmd(&tc);
+	if (r)
+		return r;
+
+	r = create_mmd(&tc);
+	if (r)
+		return r;
+
+	r = open_dev(&tc, 0, &index);
+	if (r) {
+		printk(KERN_ALERT "couldn't reopen device");
+		destroy_mmd(&tc);
+		return r;
+	}
+
+	r = nonblocking_map_pass(tc.msd[index], expected, &cold);
+	if (r) {
+		destroy_mmd(&tc);
+		return r;
+	}
+
+	r = nonblocking_map_pass(tc.msd[index], expected, &warm);
+	if (r) {
+		destroy_mmd(&tc);
+		return r;
+	}
+
+	printk(KERN_ALERT "inline lookups: cold %u/%u, warm %u/%u",
+	       cold, DATA_DEV_SIZE, warm, DATA_DEV_SIZE);
+
+	return destroy_mmd(&tc);
+}
+
 /*----------------------------------------------------------------*/
 
 typedef int (*test_fn)(void);
@@ -1686,6 +1785,7 @@ static int multisnap_metadata_test_init(void)
 		{"snapshot scenario 5",                           check_snap_scenario5},
 
 		{"devices persist",    check_devices_persist},
+		{"non blocking map from the submission path", check_nonblocking_map},
 	};
 
 	int i, r;
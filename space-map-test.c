@@ -13,8 +13,13 @@
 
 #define NR_BLOCKS 1024
 #define BM_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (64 * 1024)
 #define CACHE_SIZE 16
 
+static unsigned block_size = BM_BLOCK_SIZE;
+module_param(block_size, uint, 0444);
+MODULE_PARM_DESC(block_size, "metadata block size in bytes (4096 - 65536)");
+
 typedef int (*test_fn)(struct dm_space_map *);
 
 /*----------------------------------------------------------------*/
@@ -175,7 +180,7 @@ static int check_reopen_disk(void)
 	if (IS_ERR(bdev))
 		return -1;
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
 	if (!bm)
 		return -1;
 
@@ -269,7 +274,7 @@ static int run_test_disk(const char *name, test_fn fn)
 	if (IS_ERR(bdev))
 		return -1;
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
 	if (!bm)
 		return -1;
 
@@ -317,7 +322,7 @@ static int run_test_staged_disk(const char *name, test_fn fn)
 	if (IS_ERR(bdev))
 		return -1;
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	bm = dm_block_manager_create(bdev, block_size, CACHE_SIZE);
 	if (!bm)
 		return -1;
 
@@ -390,6 +395,12 @@ static int space_map_test_init(void)
 
 	int i;
 
+	if (block_size < BM_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+	    (block_size & (block_size - 1))) {
+		printk(KERN_ALERT "unsupported block size %u\n", block_size);
+		return -EINVAL;
+	}
+
 	printk(KERN_ALERT "running tests with core space map");
 	for (i = 0; i < sizeof(table_) / sizeof(*table_); i++)
 		run_test_core(table_[i].name, table_[i].fn);
@@ -2,6 +2,14 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/genhd.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
 
 #include "md/persistent-data/dm-transaction-manager.h"
 #include "dm-space-map-core.h"
@@ -16,11 +24,72 @@ typedef int (*test_fn)(struct dm_transaction_manager *);
 
 /*----------------------------------------------------------------*/
 
+/*
+ * Times the phases of a commit.  dm_tm_pre_commit() flushes the space
+ * map, which for the core space map used here writes nothing.
+ * dm_tm_commit() writes back the remaining dirty blocks, flushes the
+ * device and writes the superblock; the transaction manager doesn't
+ * expose the boundaries inside it, so those three are timed together.
+ *
+ * The writes happen inside the block manager, out of sight of the
+ * dm-block-manager-trace wrappers, so the blocks each commit actually
+ * wrote are counted from the device's write statistics instead.  Dirty
+ * blocks the cache has already had to evict don't show up here.
+ */
+static struct block_device *test_bdev;
+
+struct commit_stats {
+	s64 pre_commit_us;
+	s64 commit_us;
+	unsigned long blocks_written;
+};
+
+static unsigned long sectors_written(void)
+{
+	return part_stat_read(test_bdev->bd_part, sectors[WRITE]);
+}
+
+static int timed_commit(struct dm_transaction_manager *tm,
+			struct dm_block *superblock,
+			struct commit_stats *stats)
+{
+	int r;
+	ktime_t start, mid;
+	unsigned long sectors = sectors_written();
+
+	start = ktime_get();
+	r = dm_tm_pre_commit(tm);
+	if (r < 0)
+		return r;
+
+	mid = ktime_get();
+	r = dm_tm_commit(tm, superblock);
+	if (r < 0)
+		return r;
+
+	stats->pre_commit_us = ktime_to_us(ktime_sub(mid, start));
+	stats->commit_us = ktime_to_us(ktime_sub(ktime_get(), mid));
+	stats->blocks_written = (sectors_written() - sectors) / (BM_BLOCK_SIZE >> 9);
+	return 0;
+}
+
+static void print_commit_stats(struct commit_stats *stats, unsigned nr_dirty)
+{
+	printk(KERN_ALERT "%u dirty blocks + superblock, %lu blocks written: "
+	       "space map flush %lld us, write back + device flush + superblock write %lld us\n",
+	       nr_dirty, stats->blocks_written, stats->pre_commit_us, stats->commit_us);
+}
+
+/*----------------------------------------------------------------*/
+
+#define CHECK_COMMIT_BLOCKS 10
+
 static int check_commit(struct dm_transaction_manager *tm)
 {
 	int r, i;
 	dm_block_t sb;
 	struct dm_block *superblock;
+	struct commit_stats stats;
 
 	r = dm_tm_begin(tm);
 	if (r < 0)
@@ -30,46 +99,347 @@ static int check_commit(struct dm_transaction_manager *tm)
 	if (r < 0)
 		return r;
 
-	for (i = 0; i < 10; i++) {
+	for (i = 0; i < CHECK_COMMIT_BLOCKS; i++) {
 		struct dm_block *b;
 		r = dm_tm_new_block(tm, &b);
 		if (r < 0)
 			return r;
 	}
 
-	r = dm_tm_pre_commit(tm);
+	sb = dm_block_location(superblock);
+
+	r = timed_commit(tm, superblock, &stats);
 	if (r < 0)
 		return r;
+	print_commit_stats(&stats, CHECK_COMMIT_BLOCKS);
+
+	/* check the lock on superblock was dropped */
+	r = dm_tm_read_lock(tm, sb, &superblock);
+	if (r < 0)
+		return r;
+
+	return 0;
+}
+
+/*
+ * Reports commit latency as the number of blocks dirtied alongside the
+ * superblock grows.  A commit currently flushes every dirty block and the
+ * device cache whatever has changed, so the superblock-only case is the
+ * one an ordered preflush + FUA superblock write would help most.
+ */
+#define LATENCY_COMMITS 16
+#define MAX_DIRTY 64
+
+/*
+ * Big enough that none of the dirty blocks is evicted, and so written,
+ * before the commit.
+ */
+#define LATENCY_CACHE_SIZE (2 * MAX_DIRTY)
+static unsigned dirty_counts[] = { 0, 8, MAX_DIRTY };
 
+static int check_commit_latency(struct dm_transaction_manager *tm)
+{
+	int r;
+	unsigned i, j, c;
+	dm_block_t sb;
+	static dm_block_t blocks[MAX_DIRTY];
+	struct dm_block *superblock, *b;
+	struct commit_stats stats, total;
+	s64 us, worst;
+
+	r = dm_tm_begin(tm);
+	if (r < 0)
+		return r;
+
+	r = dm_tm_new_block(tm, &superblock);
+	if (r < 0)
+		return r;
 	sb = dm_block_location(superblock);
 
+	r = dm_tm_pre_commit(tm);
+	if (r < 0)
+		return r;
+
 	r = dm_tm_commit(tm, superblock);
 	if (r < 0)
 		return r;
 
-	/* check the lock on superblock was dropped */
-	r = dm_tm_read_lock(tm, sb, &superblock);
+	for (i = 0; i < ARRAY_SIZE(dirty_counts); i++) {
+		total.pre_commit_us = total.commit_us = worst = 0;
+		total.blocks_written = 0;
+		for (c = 0; c < LATENCY_COMMITS; c++) {
+			r = dm_bm_write_lock(dm_tm_get_bm(tm), sb, &superblock);
+			if (r < 0)
+				return r;
+
+			r = dm_tm_begin(tm);
+			if (r < 0)
+				return r;
+
+			for (j = 0; j < dirty_counts[i]; j++) {
+				r = dm_tm_new_block(tm, &b);
+				if (r < 0)
+					return r;
+
+				blocks[j] = dm_block_location(b);
+				dm_tm_unlock(tm, b);
+			}
+
+			r = timed_commit(tm, superblock, &stats);
+			if (r < 0)
+				return r;
+
+			us = stats.pre_commit_us + stats.commit_us;
+			total.pre_commit_us += stats.pre_commit_us;
+			total.commit_us += stats.commit_us;
+			total.blocks_written += stats.blocks_written;
+			worst = max(worst, us);
+
+			/* hand the blocks back so we don't run out of space */
+			for (j = 0; j < dirty_counts[i]; j++)
+				dm_tm_dec(tm, blocks[j]);
+		}
+
+		printk(KERN_ALERT "superblock + %u blocks: mean %lld us, max %lld us\n",
+		       dirty_counts[i],
+		       div_s64(total.pre_commit_us + total.commit_us, LATENCY_COMMITS),
+		       worst);
+
+		total.pre_commit_us = div_s64(total.pre_commit_us, LATENCY_COMMITS);
+		total.commit_us = div_s64(total.commit_us, LATENCY_COMMITS);
+		total.blocks_written /= LATENCY_COMMITS;
+		print_commit_stats(&total, dirty_counts[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * Group commit on top of the transaction manager.  Committers make their
+ * change under gc->lock and then ask for it to be committed.  The first
+ * to ask becomes leader: it waits window_us for others to join, then
+ * does one pre_commit/commit for everyone in the transaction, while the
+ * rest sleep until their transaction is on disk.  A zero window means
+ * every committer commits on its own.
+ */
+struct group_commit {
+	struct dm_transaction_manager *tm;
+	struct mutex lock;
+	wait_queue_head_t wait;
+
+	dm_block_t sb;
+	struct dm_block *superblock;
+
+	unsigned window_us;
+	int have_leader;
+	unsigned long open_gen;	/* the transaction taking changes */
+	unsigned long done_gen;	/* the last transaction committed */
+	int error;
+
+	atomic_t nr_commits;
+	unsigned nr_flushes;
+};
+
+static int gc_begin(struct group_commit *gc)
+{
+	int r = dm_bm_write_lock(dm_tm_get_bm(gc->tm), gc->sb, &gc->superblock);
+	if (r < 0)
+		return r;
+
+	return dm_tm_begin(gc->tm);
+}
+
+/* called with gc->lock held */
+static int gc_commit(struct group_commit *gc)
+{
+	int r;
+
+	r = dm_tm_pre_commit(gc->tm);
 	if (r < 0)
 		return r;
 
+	r = dm_tm_commit(gc->tm, gc->superblock);
+	if (r < 0)
+		return r;
+
+	gc->nr_flushes++;
+	gc->done_gen = gc->open_gen++;
+
+	return gc_begin(gc);
+}
+
+#define COMMITS_PER_THREAD 100
+#define MAX_COMMITTERS 8
+
+struct committer {
+	struct group_commit *gc;
+	int r;
+	struct completion done;
+};
+
+static int committer_fn(void *context)
+{
+	struct committer *c = context;
+	struct group_commit *gc = c->gc;
+	unsigned i;
+	int leader, have_last = 0;
+	unsigned long gen;
+	dm_block_t last = 0;
+	struct dm_block *b;
+
+	c->r = 0;
+	for (i = 0; i < COMMITS_PER_THREAD; i++) {
+		mutex_lock(&gc->lock);
+
+		/* only keep one block per committer, so we don't run out */
+		if (have_last)
+			dm_tm_dec(gc->tm, last);
+
+		c->r = dm_tm_new_block(gc->tm, &b);
+		if (c->r < 0) {
+			mutex_unlock(&gc->lock);
+			break;
+		}
+		last = dm_block_location(b);
+		have_last = 1;
+		dm_tm_unlock(gc->tm, b);
+
+		gen = gc->open_gen;
+		leader = 0;
+		if (!gc->window_us)
+			c->r = gc_commit(gc);
+
+		else if (!gc->have_leader)
+			gc->have_leader = leader = 1;
+		mutex_unlock(&gc->lock);
+
+		if (leader) {
+			usleep_range(gc->window_us, 2 * gc->window_us);
+
+			mutex_lock(&gc->lock);
+			c->r = gc_commit(gc);
+			if (c->r < 0)
+				gc->error = c->r;
+			gc->have_leader = 0;
+			mutex_unlock(&gc->lock);
+
+			wake_up_all(&gc->wait);
+
+		} else if (gc->window_us) {
+			wait_event(gc->wait, gc->done_gen >= gen || gc->error);
+			c->r = gc->error;
+		}
+
+		if (c->r < 0)
+			break;
+
+		atomic_inc(&gc->nr_commits);
+	}
+
+	complete(&c->done);
 	return 0;
 }
 
+static int run_committers(struct group_commit *gc, unsigned nr_threads)
+{
+	int r = 0;
+	unsigned i;
+	struct task_struct *task;
+	static struct committer committers[MAX_COMMITTERS];
+
+	for (i = 0; i < nr_threads; i++) {
+		committers[i].gc = gc;
+		init_completion(&committers[i].done);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		task = kthread_run(committer_fn, committers + i, "tm-commit/%u", i);
+		if (IS_ERR(task)) {
+			r = PTR_ERR(task);
+			nr_threads = i;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		wait_for_completion(&committers[i].done);
+		if (committers[i].r < 0)
+			r = committers[i].r;
+	}
+
+	return r;
+}
+
+static unsigned long long per_sec(unsigned long long count, s64 us)
+{
+	return us > 0 ? div64_u64(count * USEC_PER_SEC, us) : 0;
+}
+
+static unsigned group_windows[] = { 0, 100, 1000 };
+
+static int check_group_commit(struct dm_transaction_manager *tm)
+{
+	int r;
+	unsigned i, nr_threads = min(num_online_cpus(), (unsigned) MAX_COMMITTERS);
+	struct group_commit gc;
+	ktime_t start;
+	s64 us;
+
+	memset(&gc, 0, sizeof(gc));
+	gc.tm = tm;
+	mutex_init(&gc.lock);
+	init_waitqueue_head(&gc.wait);
+	gc.open_gen = 1;
+
+	r = dm_tm_begin(tm);
+	if (r < 0)
+		return r;
+
+	r = dm_tm_new_block(tm, &gc.superblock);
+	if (r < 0)
+		return r;
+	gc.sb = dm_block_location(gc.superblock);
+
+	for (i = 0; i < ARRAY_SIZE(group_windows); i++) {
+		gc.window_us = group_windows[i];
+		atomic_set(&gc.nr_commits, 0);
+		gc.nr_flushes = 0;
+
+		start = ktime_get();
+		r = run_committers(&gc, nr_threads);
+		us = ktime_to_us(ktime_sub(ktime_get(), start));
+		if (r < 0)
+			return r;
+
+		printk(KERN_ALERT "%u threads, window %u us: %llu commits/sec, %llu flushes/sec\n",
+		       nr_threads, gc.window_us,
+		       per_sec(atomic_read(&gc.nr_commits), us),
+		       per_sec(gc.nr_flushes, us));
+	}
+
+	r = dm_tm_pre_commit(tm);
+	if (r < 0)
+		return r;
+
+	return dm_tm_commit(tm, gc.superblock);
+}
+
 /*----------------------------------------------------------------*/
 
-static int run_test(const char *name, test_fn fn)
+static int run_test_with_cache(const char *name, test_fn fn, unsigned cache_size)
 {
 	int r;
 	struct dm_space_map *sm = dm_sm_core_create(NR_BLOCKS);
 	int mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
-	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode, &run_test);
+	struct block_device *bdev = blkdev_get_by_path("/dev/sdb", mode,
+						       &run_test_with_cache);
 	struct dm_block_manager *bm;
 	struct dm_transaction_manager *tm;
 
 	if (IS_ERR(bdev))
 		return -1;
 
-	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, CACHE_SIZE);
+	bm = dm_block_manager_create(bdev, BM_BLOCK_SIZE, cache_size);
 	if (!bm)
 		return -1;
 
@@ -77,6 +447,7 @@ static int run_test(const char *name, test_fn fn)
 	if (!tm)
 		return -1;
 
+	test_bdev = bdev;
 	printk(KERN_ALERT "running %s ... ", name);
 	r = fn(tm);
 	printk(r == 0 ? KERN_ALERT "pass\n" : KERN_ALERT "fail\n");
@@ -88,13 +459,19 @@ static int run_test(const char *name, test_fn fn)
 	return 0;
 }
 
+static int run_test(const char *name, test_fn fn)
+{
+	return run_test_with_cache(name, fn, CACHE_SIZE);
+}
+
 static int transaction_manager_test_init(void)
 {
 	static struct {
 		const char *name;
 		test_fn fn;
 	} table_[] = {
-		{"check commit", check_commit}
+		{"check commit", check_commit},
+		{"group commit", check_group_commit}
 	};
 
 	int i;
@@ -102,6 +479,8 @@ static int transaction_manager_test_init(void)
 	for (i = 0; i < sizeof(table_) / sizeof(*table_); i++)
 		run_test(table_[i].name, table_[i].fn);
 
+	run_test_with_cache("commit latency", check_commit_latency, LATENCY_CACHE_SIZE);
+
 	return 0;
 }
 